@@ -884,6 +884,19 @@ void DistanceTransform3Dfloat(Array3dDEucl3D& A, float d1,float d2,float d3){
 DT3D::DT3D()
 {
 	A.data = NULL;
+	buildMinPyramid = false;
+	pyrLevels = 0;
+	buildClosestPoint = false;
+	closestPointMissing = 0;
+	cpt = NULL;
+}
+
+DT3D::~DT3D()
+{
+	for(int m = 1; m < pyrLevels; m++)
+		delete [] pyr[m];
+	if(cpt)
+		free(cpt);
 }
 
 void DT3D::Build(double* _x, double* _y, double* _z, int num)
@@ -966,6 +979,9 @@ void DT3D::Build(double* _x, double* _y, double* _z, int num)
 
 	DEuclidean(A);
 
+	if(buildClosestPoint)
+		BuildClosestPoint(_x, _y, _z, num);
+
 	for(z=0; z<Zdim; z++) {
 		for(y=0; y<Ydim; y++) {
 			for(x=0; x<Xdim; x++) {
@@ -976,6 +992,120 @@ void DT3D::Build(double* _x, double* _y, double* _z, int num)
 			}
 		}
 	}
+
+	if(buildMinPyramid)
+		BuildPyramid();
+}
+
+// The raster passes keep the unsigned offsets v,h,d (along x,y,z) from each voxel to its nearest
+// site, so the site is the one of the (up to) 8 signed offsets that lands on a site voxel.
+// Sites are the voxels at distance 0, their model point index is recorded before the lookups.
+void DT3D::BuildClosestPoint(double* _x, double* _y, double* _z, int num)
+{
+	int i, s, x, y, z, sx, sy, sz;
+
+	if(cpt == NULL)
+		cpt = (int*)malloc(sizeof(int)*SIZE*SIZE*SIZE);
+	for(i = 0; i < SIZE*SIZE*SIZE; i++)
+		cpt[i] = -1;
+
+	for(i = 0; i < num; i++)
+	{
+		x = ROUND((_x[i]-xMin)*scale);
+		y = ROUND((_y[i]-yMin)*scale);
+		z = ROUND((_z[i]-zMin)*scale);
+		if(x<0 || x>=SIZE || y<0 || y>=SIZE || z<0 || z>=SIZE)
+			continue;
+		cpt[(z*SIZE + y)*SIZE + x] = i;
+	}
+
+	closestPointMissing = 0;
+	for(z = 0; z < SIZE; z++)
+	for(y = 0; y < SIZE; y++)
+	for(x = 0; x < SIZE; x++)
+	{
+		DEucl3D& e = A.data[z][y][x];
+		if(e.distance == 0)
+			continue;
+		for(s = 0; s < 8; s++)
+		{
+			sx = x + ((s&1) ? -e.v : e.v);
+			sy = y + ((s&2) ? -e.h : e.h);
+			sz = z + ((s&4) ? -e.d : e.d);
+			if(sx<0 || sx>=SIZE || sy<0 || sy>=SIZE || sz<0 || sz>=SIZE)
+				continue;
+			if(A.data[sz][sy][sx].distance == 0)
+			{
+				cpt[(z*SIZE + y)*SIZE + x] = cpt[(sz*SIZE + sy)*SIZE + sx];
+				break;
+			}
+		}
+		if(s == 8)
+			closestPointMissing ++;
+	}
+}
+
+void DT3D::BuildPyramid()
+{
+	int m, n, nPrev, x, y, z, i, j, k, xi, yj, zk;
+	float v, vmin;
+
+	for(m = 1; m < pyrLevels; m++)
+		delete [] pyr[m];
+
+	// Stop at the first level that has a single window covering the whole grid
+	for(m = 1; m < MAXPYRLEVEL; m++)
+	{
+		n = (SIZE + (1<<m) - 1) >> m;
+		pyrSize[m] = n;
+		pyr[m] = new float[n*n*n];
+
+		for(z = 0; z < n; z++)
+		for(y = 0; y < n; y++)
+		for(x = 0; x < n; x++)
+		{
+			vmin = infty;
+			if(m == 1)
+			{
+				// Voxels 2x..2x+3 along each axis
+				for(k = 0; k < 4; k++)
+				for(j = 0; j < 4; j++)
+				for(i = 0; i < 4; i++)
+				{
+					xi = 2*x+i; yj = 2*y+j; zk = 2*z+k;
+					if(xi >= SIZE || yj >= SIZE || zk >= SIZE)
+						continue;
+					v = A.data[zk][yj][xi].distance;
+					if(v < vmin)
+						vmin = v;
+				}
+			}
+			else
+			{
+				// Windows 2x and 2x+2 of the previous level cover this one
+				nPrev = pyrSize[m-1];
+				for(k = 0; k < 3; k += 2)
+				for(j = 0; j < 3; j += 2)
+				for(i = 0; i < 3; i += 2)
+				{
+					xi = 2*x+i; yj = 2*y+j; zk = 2*z+k;
+					if(xi >= nPrev || yj >= nPrev || zk >= nPrev)
+						continue;
+					v = pyr[m-1][(zk*nPrev + yj)*nPrev + xi];
+					if(v < vmin)
+						vmin = v;
+				}
+			}
+			pyr[m][(z*n + y)*n + x] = vmin;
+		}
+
+		if(n == 1)
+		{
+			m++;
+			break;
+		}
+	}
+	pyrLevels = m;
 }
 
 float DT3D::Distance(double _x, double _y, double _z)
@@ -1024,3 +1154,209 @@ float DT3D::Distance(double _x, double _y, double _z)
 		
 	return sqrt(a*a+b*b+c*c)/scale + A.data[z][y][x].distance;
 }
+
+// Pyramid level to look up boxes of half side h with MinDistance
+// A box spanning at most 2^m voxels lies inside the level m window starting at or below its corner,
+// level 0 means a single voxel and -1 that the box exceeds the pyramid
+int DT3D::PyramidLevel(double h)
+{
+	int m, span;
+
+	span = (int)ceil(2*h*scale);
+	if(span == 0)
+		return 0;
+	for(m = 1; m < pyrLevels && (1<<m) < span; m++);
+	if(m >= pyrLevels)
+		return -1;
+	return m;
+}
+
+// Lower bound of Distance() over the axis-aligned box of half side h centred at (x,y,z),
+// where level is PyramidLevel(h)
+// Points outside the grid are no closer than their clamped voxel, so the corner is clamped
+float DT3D::MinDistance(double _x, double _y, double _z, double h, int level)
+{
+	int x, y, z, n;
+
+	if(level < 0)
+		return 0;
+
+	x = ROUND((_x-h-xMin)*scale);
+	y = ROUND((_y-h-yMin)*scale);
+	z = ROUND((_z-h-zMin)*scale);
+
+	if(x < 0) x = 0; else if(x >= SIZE) x = SIZE-1;
+	if(y < 0) y = 0; else if(y >= SIZE) y = SIZE-1;
+	if(z < 0) z = 0; else if(z >= SIZE) z = SIZE-1;
+
+	if(level == 0)
+		return A.data[z][y][x].distance;
+
+	n = pyrSize[level];
+	return pyr[level][((z>>level)*n + (y>>level))*n + (x>>level)];
+}
+
+// ************************************
+//  
+//       2D DT
+//
+// ************************************
+
+// Offer the nearest site of pixel (x+dx,y+dy) to pixel (x,y)
+// h,v is the offset from a pixel to its nearest site
+static inline void DEuclidean2DCompare(DEucl* A, int n, int x, int y, int dx, int dy)
+{
+	DEucl& p = A[y*n + x];
+	const DEucl& q = A[(y+dy)*n + x+dx];
+	int h, v;
+	float d;
+
+	if(q.distance >= infty)
+		return;
+	h = q.h + dx;
+	v = q.v + dy;
+	d = sqrt1(h*h + v*v);
+	if(d < p.distance)
+	{
+		p.h = h;
+		p.v = v;
+		p.distance = d;
+	}
+}
+
+// Two-pass 8-neighbour vector propagation (8SSEDT) over an n x n grid
+static void DEuclidean2D(DEucl* A, int n)
+{
+	int x, y;
+
+	for(y = 0; y < n; y++)
+	{
+		for(x = 0; x < n; x++)
+		{
+			if(x > 0) DEuclidean2DCompare(A, n, x, y, -1, 0);
+			if(y > 0)
+			{
+				DEuclidean2DCompare(A, n, x, y, 0, -1);
+				if(x > 0) DEuclidean2DCompare(A, n, x, y, -1, -1);
+				if(x < n-1) DEuclidean2DCompare(A, n, x, y, 1, -1);
+			}
+		}
+		for(x = n-2; x > -1; x--)
+			DEuclidean2DCompare(A, n, x, y, 1, 0);
+	}
+	for(y = n-1; y > -1; y--)
+	{
+		for(x = n-1; x > -1; x--)
+		{
+			if(x < n-1) DEuclidean2DCompare(A, n, x, y, 1, 0);
+			if(y < n-1)
+			{
+				DEuclidean2DCompare(A, n, x, y, 0, 1);
+				if(x > 0) DEuclidean2DCompare(A, n, x, y, -1, 1);
+				if(x < n-1) DEuclidean2DCompare(A, n, x, y, 1, 1);
+			}
+		}
+		for(x = 1; x < n; x++)
+			DEuclidean2DCompare(A, n, x, y, -1, 0);
+	}
+}
+
+DT2D::DT2D()
+{
+	D = NULL;
+}
+
+DT2D::~DT2D()
+{
+	if(D)
+		free(D);
+}
+
+void DT2D::Build(double* _x, double* _y, int num)
+{
+	xMin=_x[0]; xMax=_x[0]; yMin=_y[0]; yMax=_y[0];
+	int i, x, y;
+	for(i = 1; i < num; i ++)
+	{
+		if(xMin > _x[i]) xMin = _x[i];
+		if(xMax < _x[i]) xMax = _x[i];
+		if(yMin > _y[i]) yMin = _y[i];
+		if(yMax < _y[i]) yMax = _y[i];
+	}
+
+	double xCenter = (xMin+xMax)/2;
+	double yCenter = (yMin+yMax)/2;
+	double max = xMax-xMin > yMax-yMin ? xMax-xMin : yMax-yMin;
+	max *= expandFactor;
+
+	xMin = xCenter - max/2;
+	xMax = xCenter + max/2;
+	yMin = yCenter - max/2;
+	yMax = yCenter + max/2;
+
+	scale = SIZE/max;
+
+	// The site offsets are only needed while propagating
+	DEucl* A = (DEucl*)malloc(sizeof(DEucl)*SIZE*SIZE);
+	for(i = 0; i < SIZE*SIZE; i++)
+	{
+		A[i].distance = infty;
+		A[i].h = infty;
+		A[i].v = infty;
+	}
+	for(i = 0; i < num; i++)
+	{
+		x = ROUND((_x[i]-xMin)*scale);
+		y = ROUND((_y[i]-yMin)*scale);
+
+		if(x<0 || x>=SIZE || y<0 || y>=SIZE)
+			continue;
+
+		A[y*SIZE+x].distance = 0;
+		A[y*SIZE+x].h = 0;
+		A[y*SIZE+x].v = 0;
+	}
+
+	DEuclidean2D(A, SIZE);
+
+	if(D == NULL)
+		D = (float*)malloc(sizeof(float)*SIZE*SIZE);
+	for(i = 0; i < SIZE*SIZE; i++)
+		D[i] = A[i].distance/scale;
+	free(A);
+}
+
+float DT2D::Distance(double _x, double _y)
+{
+	int x, y;
+	x = ROUND((_x-xMin)*scale);
+	y = ROUND((_y-yMin)*scale);
+
+	if(x > -1 && x < SIZE && y > -1 && y < SIZE)
+		return D[y*SIZE+x];
+
+	float a = 0, b = 0;
+	if(x < 0)
+	{
+		a = x;
+		x = 0;
+	}
+	else if(x >= SIZE)
+	{
+		a = x-SIZE+1;
+		x = SIZE-1;
+	}
+		
+	if(y < 0)
+	{
+		b = y;
+		y = 0;
+	}
+	else if(y >= SIZE)
+	{
+		b = y-SIZE+1;
+		y = SIZE-1;
+	}
+		
+	return sqrt(a*a+b*b)/scale + D[y*SIZE+x];
+}
@@ -97,17 +97,53 @@ void Array3d<T>::printArrayDE(int x)
 typedef Array3d<DEucl3D> Array3dDEucl3D;
 typedef Array3d<float> Array3dfloat;
 
+#define MAXPYRLEVEL 16
+
 class DT3D{
 public:
 	DT3D();
+	~DT3D();
 	int SIZE;
 	double scale;
 	double expandFactor;
 	double xMin, xMax, yMin, yMax, zMin, zMax;
+	bool buildMinPyramid;
+	bool buildClosestPoint;
+	long long closestPointMissing; // voxels whose nearest model point could not be recovered
 	void Build(double* x, double* y, double* z, int num);
 	float Distance(double x, double y, double z);
+	int PyramidLevel(double h);
+	float MinDistance(double x, double y, double z, double h, int level);
+	const int * ClosestPointGrid() { return cpt; }
 private:
 	Array3dDEucl3D A;
+
+	// Closest-point transform: index of the nearest model point of each voxel (z-major like A),
+	// or -1 where it could not be recovered
+	int * cpt;
+	void BuildClosestPoint(double* x, double* y, double* z, int num);
+
+	// Min-pooling pyramid, level m (m >= 1) holds the minimum distance over windows
+	// of 2^(m+1) voxels along each axis, placed every 2^m voxels
+	int pyrLevels;
+	int pyrSize[MAXPYRLEVEL];
+	float * pyr[MAXPYRLEVEL];
+	void BuildPyramid();
+};
+
+// 2D Euclidean DT of the xy projection of a point set, for planar registration
+class DT2D{
+public:
+	DT2D();
+	~DT2D();
+	int SIZE;
+	double scale;
+	double expandFactor;
+	double xMin, xMax, yMin, yMax;
+	void Build(double* x, double* y, int num);
+	float Distance(double x, double y);
+private:
+	float * D; // SIZE x SIZE distances, row-major
 };
 
 #endif
@@ -26,11 +26,24 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <math.h>
 #include <time.h>
 #include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <algorithm>
+#include <chrono>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 //using namespace std;
 
 #include "jly_goicp.h"
 #include "jly_sorting.hpp"
 
+// Wall-clock seconds, CPU time would count the other threads as well
+static double WallTime()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 GoICP::GoICP()
 {
 	initNodeRot.a = -PI;
@@ -38,11 +51,38 @@ GoICP::GoICP()
 	initNodeRot.c = -PI;
 	initNodeRot.w = 2*PI;
 	initNodeRot.l = 0;
+	initNodeRot.f = 0;
 
 	initNodeRot.lb = 0;
 	initNodeTrans.lb = 0;
 
 	doTrim = true;
+	upperBoundMode = UB_EAGER;
+	lbSubsetSize = 0;
+	dataClusterLevels = 0;
+	transBoxBound = false;
+	shellBoundFactor = 0;
+	rotSearchMode = SEARCH_BEST_BOUND;
+	transSearchMode = SEARCH_BEST_BOUND;
+	diveInterval = 0;
+	multiStartCount = 0;
+	multiStartTime = 0;
+	rotDomain = ROTDOMAIN_ANGLEAXIS;
+	registrationMode = REG_FULL;
+	icpClosestPoint = ICP_NN_KDTREE;
+	icpPointToPlane = false;
+	icpWarmStart = false;
+	icpCoarseStages = 0;
+	localOptimizer = LOCAL_ICP;
+	asyncICP = false;
+	icpCacheSize = 0;
+	icpMinImprovement = 0;
+	icpTimeBudget = 0;
+	icpAdaptiveIter = false;
+	asyncRunning = false;
+	asyncDis = NULL;
+	fixedR = Matrix::eye(3);
+	fixedT = Matrix(3,1);
 }
 
 // Build Distance Transform
@@ -57,109 +97,849 @@ void GoICP::BuildDT()
 		y[i] = pModel[i].y;
 		z[i] = pModel[i].z;
 	}
-	dt.Build(x, y, z, Nm);
+	if(registrationMode == REG_PLANAR)
+	{
+		dt2.SIZE = dt.SIZE;
+		dt2.expandFactor = dt.expandFactor;
+		dt2.Build(x, y, Nm);
+	}
+	else
+	{
+		dt.buildMinPyramid = transBoxBound;
+		dt.buildClosestPoint = icpClosestPoint != ICP_NN_KDTREE;
+		dt.Build(x, y, z, Nm);
+	}
 	delete(x);
 	delete(y);
 	delete(z);
 }
 
-// Run ICP and calculate sum squared L2 error
+// Run the local optimizer (ICP by default) and calculate sum squared L2 error
 float GoICP::ICP(Matrix& R_icp, Matrix& t_icp)
 {
-  int i;
-	float error, dis;
+	float error;
+	double timeBegin = WallTime();
 
-	icp3d.Run(D_icp, Nd, R_icp, t_icp); // data cloud, # data points, rotation matrix, translation matrix
+	localCount ++;
+	if(localOptimizer == LOCAL_DT_LM)
+	{
+		error = DTRefine(R_icp, t_icp);
+		localTime += WallTime() - timeBegin;
+		return error;
+	}
+
+	// ICP cannot keep a part of the pose fixed, only evaluate the pose then
+	if(registrationMode == REG_FULL || registrationMode == REG_PLANAR)
+		error = ICPRun(R_icp, t_icp, minDis);
+	else
+		error = PoseError(R_icp, t_icp, minDis);
+	localTime += WallTime() - timeBegin;
+
+	return error;
+}
+
+// ICP3D from R_icp, t_icp scored against the DT (residuals in dis), or the cached minimum of
+// the basin the start lies in (icpCacheSize)
+float GoICP::ICPRun(Matrix& R_icp, Matrix& t_icp, float* dis)
+{
+	int i, worst;
+	float error, radius;
+	long long key;
+	size_t cap, iterations;
+	bool truncated;
+	Matrix R0, t0;
+	map<long long, int>::iterator it;
+
+	icp3d.aborted = false;
+	if(icpCacheSize > 0)
+	{
+		icpCacheLookups ++;
+		for(i = 0; i < (int)icpCache.size(); i++)
+		{
+			if(PoseDistance(R_icp, t_icp, icpCache[i].R, icpCache[i].t) <= icpCache[i].radius)
+			{
+				icpCacheHits ++;
+				R_icp = icpCache[i].R;
+				t_icp = icpCache[i].t;
+				return icpCache[i].error;
+			}
+		}
+		R0 = R_icp;
+		t0 = t_icp;
+	}
+
+	cap = icpAdaptiveIter ? icpIterCap : icp3d.max_iter_def;
+	if(registrationMode == REG_PLANAR)
+		icp3d.RunPlanar(D_icp, Nd, R_icp, t_icp, cap, iterations);
+	else
+		icp3d.Run(D_icp, Nd, R_icp, t_icp, cap, iterations); // data cloud, # data points, rotation matrix, translation matrix
+	error = PoseError(R_icp, t_icp, dis);
+
+	truncated = iterations >= cap;
+	if(truncated)
+		icpTruncated ++;
+	if(icpAdaptiveIter && !icp3d.aborted)
+	{
+		if(truncated)
+			icpIterCap = 2*cap < icp3d.max_iter_def ? 2*cap : icp3d.max_iter_def;
+		else
+			icpIterCap = ICP_ITER_CAP_FACTOR*iterations > ICP_ITER_CAP_MIN ? ICP_ITER_CAP_FACTOR*iterations : ICP_ITER_CAP_MIN;
+	}
+
+	// A run stopped by a limit or by the background search has not reached its minimum
+	if(icpCacheSize <= 0 || icp3d.aborted || truncated)
+		return error;
+
+	// Runs ending in the same voxel found the same minimum, which widens its basin
+	key = PoseKey(R_icp, t_icp);
+	if(key < 0)
+		return error;
+	radius = ICP_BASIN_FACTOR*PoseDistance(R0, t0, R_icp, t_icp);
+	it = icpCacheIndex.find(key);
+	if(it != icpCacheIndex.end())
+	{
+		ICPCACHEENTRY& entry = icpCache[it->second];
+		if(radius > entry.radius)
+			entry.radius = radius;
+		if(error < entry.error)
+		{
+			entry.R = R_icp;
+			entry.t = t_icp;
+			entry.error = error;
+		}
+		return error;
+	}
+
+	// A full cache gives up its worst minimum for a better one
+	ICPCACHEENTRY entry;
+	entry.R = R_icp;
+	entry.t = t_icp;
+	entry.error = error;
+	entry.radius = radius;
+	entry.key = key;
+	if((int)icpCache.size() < icpCacheSize)
+	{
+		icpCacheIndex[key] = icpCache.size();
+		icpCache.push_back(entry);
+		return error;
+	}
+	worst = 0;
+	for(i = 1; i < (int)icpCache.size(); i++)
+		if(icpCache[i].error > icpCache[worst].error)
+			worst = i;
+	if(icpCache[worst].error > error)
+	{
+		icpCacheIndex.erase(icpCache[worst].key);
+		icpCacheIndex[key] = worst;
+		icpCache[worst] = entry;
+	}
+
+	return error;
+}
+
+// Largest displacement of a data point between two poses
+float GoICP::PoseDistance(const Matrix& R1, const Matrix& t1, const Matrix& R2, const Matrix& t2)
+{
+	int i, j;
+	double tr, c, dx, dy, dz;
+
+	// trace(R1^T R2) = 1 + 2 cos(angle)
+	tr = 0;
+	for(i = 0; i < 3; i++)
+		for(j = 0; j < 3; j++)
+			tr += R1.val[i][j]*R2.val[i][j];
+	c = (tr - 1)/2;
+	c = c > 1 ? 1 : (c < -1 ? -1 : c);
+	dx = t1.val[0][0] - t2.val[0][0];
+	dy = t1.val[1][0] - t2.val[1][0];
+	dz = t1.val[2][0] - t2.val[2][0];
+
+	return sqrt(2*(1-c))*maxDataNorm + sqrt(dx*dx + dy*dy + dz*dz);
+}
+
+// Pose quantized to DT voxels: translation and angle-axis rotation scaled by the data radius,
+// 10 bits per coordinate. Only coordinates within [-512, 511] voxels fit, i.e. translations
+// within 512 voxels of the origin and rotation angles up to 512/(maxDataNorm*scale); other poses
+// have no key (-1) rather than one shared with an unrelated pose.
+long long GoICP::PoseKey(const Matrix& R, const Matrix& t)
+{
+	int j, q;
+	double c, angle, s, v[6], cell, d;
+	long long key;
+
+	c = (R.val[0][0] + R.val[1][1] + R.val[2][2] - 1)/2;
+	angle = acos(c > 1 ? 1 : (c < -1 ? -1 : c));
+	s = sin(angle);
+	s = s > 1e-6 ? angle/(2*s) : 0.5;
+	v[0] = (R.val[2][1] - R.val[1][2])*s*maxDataNorm;
+	v[1] = (R.val[0][2] - R.val[2][0])*s*maxDataNorm;
+	v[2] = (R.val[1][0] - R.val[0][1])*s*maxDataNorm;
+	for(j = 0; j < 3; j++)
+		v[3+j] = t.val[j][0];
+
+	cell = 1.0/(registrationMode == REG_PLANAR ? dt2.scale : dt.scale);
+	key = 0;
+	for(j = 0; j < 6; j++)
+	{
+		d = floor(v[j]/cell + 0.5);
+		if(d < -512 || d > 511)
+			return -1;
+		q = (int)d;
+		key = (key << 10) | (q + 512);
+	}
+	return key;
+}
+
+// Start the background ICP thread for the outer search (asyncICP)
+void GoICP::AsyncICPStart()
+{
+	asyncPending = asyncBusy = asyncStop = asyncHaveResult = false;
+	asyncAbortAbove = FLT_MAX;
+	icp3d.abort_above = &asyncAbortAbove;
+	asyncThread = thread(&GoICP::AsyncICPWorker, this);
+}
+
+// Queue an ICP run from R, t, whose DT error is error. Only the most promising start waits:
+// it replaces a worse pending one, and a running ICP still above its error is stopped.
+void GoICP::AsyncICPPost(const Matrix& R, const Matrix& t, float error)
+{
+	lock_guard<mutex> lock(asyncMutex);
+
+	asyncPosted ++;
+	if(asyncPending)
+	{
+		asyncMerged ++;
+		if(asyncStartError <= error)
+			return;
+	}
+	asyncR = R;
+	asyncT = t;
+	asyncStartError = error;
+	asyncPending = true;
+	asyncAbortAbove = error;
+	asyncCond.notify_all();
+}
+
+// Take over a finished ICP result if it improves on the incumbent
+void GoICP::AsyncICPAdopt(ROTQUEUE& queueRot)
+{
+	{
+		lock_guard<mutex> lock(asyncMutex);
+		if(!asyncHaveResult)
+			return;
+		asyncHaveResult = false;
+		if(asyncResultError >= optError)
+			return;
+		optError = asyncResultError;
+		optR = asyncResultR;
+		optT = asyncResultT;
+		asyncAdopted ++;
+	}
+
+	cout << "Error*: " << optError << " (async ICP)" << endl;
+	PruneRotQueue(queueRot);
+}
+
+// Wait for the pending and running ICP, then stop the thread
+void GoICP::AsyncICPFinish()
+{
+	double timeBegin = WallTime();
+	{
+		unique_lock<mutex> lock(asyncMutex);
+		while(asyncPending || asyncBusy)
+			asyncCond.wait(lock);
+		asyncStop = true;
+		asyncCond.notify_all();
+	}
+	asyncThread.join();
+	icp3d.abort_above = NULL;
+	asyncWaitTime += WallTime() - timeBegin;
+}
+
+void GoICP::AsyncICPWorker()
+{
+	unique_lock<mutex> lock(asyncMutex);
+	Matrix R_icp, t_icp;
+	float error;
+	double timeBegin;
+
+	while(1)
+	{
+		while(!asyncPending && !asyncStop)
+			asyncCond.wait(lock);
+		if(!asyncPending)
+			break;
+
+		R_icp = asyncR;
+		t_icp = asyncT;
+		asyncPending = false;
+		asyncBusy = true;
+		asyncAbortAbove = FLT_MAX;
+		lock.unlock();
+
+		// The outer search does not touch icp3d and its cache while the thread runs,
+		// and scores with its own buffer
+		timeBegin = WallTime();
+		error = ICPRun(R_icp, t_icp, asyncDis);
+
+		lock.lock();
+		asyncBusy = false;
+		localCount ++;
+		localTime += WallTime() - timeBegin;
+		if(icp3d.aborted)
+			asyncAborted ++;
+		if(!asyncHaveResult || error < asyncResultError)
+		{
+			asyncResultR = R_icp;
+			asyncResultT = t_icp;
+			asyncResultError = error;
+			asyncHaveResult = true;
+		}
+		asyncCond.notify_all();
+	}
+}
+
+// Trimmed DT error of the pose R, t, with the per-point residuals in dis (in data order)
+// and the largest inlier residual in thresh
+float GoICP::DTRefineError(const double R[3][3], const double t[3], float* dis, float& thresh)
+{
+	int i;
+	float error;
 
-	// Transform point cloud and use DT to determine the L2 error
-	error = 0;
 	for(i = 0; i < Nd; i++)
 	{
 		POINT3D& p = pData[i];
-		pDataTempICP[i].x = R_icp.val[0][0]*p.x+R_icp.val[0][1]*p.y+R_icp.val[0][2]*p.z  + t_icp.val[0][0];
-		pDataTempICP[i].y = R_icp.val[1][0]*p.x+R_icp.val[1][1]*p.y+R_icp.val[1][2]*p.z + t_icp.val[1][0];
-		pDataTempICP[i].z = R_icp.val[2][0]*p.x+R_icp.val[2][1]*p.y+R_icp.val[2][2]*p.z + t_icp.val[2][0];
+		dis[i] = DTAt(R[0][0]*p.x + R[0][1]*p.y + R[0][2]*p.z + t[0],
+			R[1][0]*p.x + R[1][1]*p.y + R[1][2]*p.z + t[1],
+			R[2][0]*p.x + R[2][1]*p.y + R[2][2]*p.z + t[2]);
+		minDis[i] = dis[i];
+	}
+
+	if(doTrim)
+		intro_select(minDis,0,Nd-1,inlierNum-1);
+	error = 0;
+	thresh = 0;
+	for(i = 0; i < inlierNum; i++)
+	{
+		error += minDis[i]*minDis[i];
+		if(minDis[i] > thresh)
+			thresh = minDis[i];
+	}
+
+	return error;
+}
 
-		if(!doTrim)
+// Levenberg-Marquardt on the trimmed DT error: r_i = DT(R p_i + t) over the inliers, with the
+// pose updated as exp(w) (R p + t) + u. The DT gradient is a central difference over one voxel,
+// so d r_i / d(w, u) = ((q x g)^T, g^T) at q = R p_i + t. Parameters fixed by the registration
+// mode are left out of the normal equations, and with the translation fixed the rotation
+// step only turns R p (Rn = exp(w) R, tn = t).
+float GoICP::DTRefine(Matrix& R, Matrix& t)
+{
+	int i, j, k, iter, nAct, nIn, act[6];
+	double R0[3][3], t0[3], Rn[3][3], tn[3], dR[3][3];
+	double H[6][6], b[6], A[6][6], L[6][6], x[6], xi[6];
+	double J[6], q[3], g[3], qn[3], w, ct, st, v[3], lambda, s;
+	float error, errorNew, thresh, threshNew, r, h, * tmp;
+	bool accepted;
+
+	// Active parameters: rotation w (0..2) and translation u (3..5)
+	nAct = 0;
+	if(registrationMode == REG_PLANAR)
+	{
+		act[nAct++] = 2; act[nAct++] = 3; act[nAct++] = 4;
+	}
+	else
+	{
+		if(registrationMode != REG_TRANSLATION_ONLY)
+			for(j = 0; j < 3; j++) act[nAct++] = j;
+		if(registrationMode != REG_ROTATION_ONLY)
+			for(j = 3; j < 6; j++) act[nAct++] = j;
+	}
+
+	for(j = 0; j < 3; j++)
+	{
+		for(k = 0; k < 3; k++)
+			R0[j][k] = R.val[j][k];
+		t0[j] = t.val[j][0];
+	}
+	h = 1.0/(registrationMode == REG_PLANAR ? dt2.scale : dt.scale);
+
+	error = DTRefineError(R0, t0, refineDis[0], thresh);
+	lambda = 1e-3;
+	for(iter = 0; iter < DTLM_MAXITER; iter++)
+	{
+		// Normal equations over the inliers of the current pose
+		memset(H, 0, sizeof(H));
+		memset(b, 0, sizeof(b));
+		nIn = 0;
+		for(i = 0; i < Nd && nIn < inlierNum; i++)
 		{
-			dis = dt.Distance(pDataTempICP[i].x, pDataTempICP[i].y, pDataTempICP[i].z);
-			error += dis*dis;
+			r = refineDis[0][i];
+			if(r > thresh)
+				continue;
+			nIn ++;
+
+			POINT3D& p = pData[i];
+			for(j = 0; j < 3; j++)
+				q[j] = R0[j][0]*p.x + R0[j][1]*p.y + R0[j][2]*p.z + t0[j];
+			g[0] = (DTAt(q[0]+h, q[1], q[2]) - DTAt(q[0]-h, q[1], q[2]))/(2*h);
+			g[1] = (DTAt(q[0], q[1]+h, q[2]) - DTAt(q[0], q[1]-h, q[2]))/(2*h);
+			g[2] = registrationMode == REG_PLANAR ? 0 : (DTAt(q[0], q[1], q[2]+h) - DTAt(q[0], q[1], q[2]-h))/(2*h);
+
+			if(registrationMode == REG_ROTATION_ONLY)
+				for(j = 0; j < 3; j++)
+					q[j] -= t0[j];
+			J[0] = q[1]*g[2] - q[2]*g[1];
+			J[1] = q[2]*g[0] - q[0]*g[2];
+			J[2] = q[0]*g[1] - q[1]*g[0];
+			J[3] = g[0]; J[4] = g[1]; J[5] = g[2];
+			for(j = 0; j < nAct; j++)
+			{
+				b[j] += J[act[j]]*r;
+				for(k = 0; k <= j; k++)
+					H[j][k] += J[act[j]]*J[act[k]];
+			}
 		}
-		else
+
+		// Damped steps until one lowers the error
+		accepted = false;
+		while(!accepted && lambda < 1e8)
+		{
+			// Cholesky solve of (H + lambda diag(H)) x = -b
+			for(j = 0; j < nAct; j++)
+				for(k = 0; k <= j; k++)
+					A[j][k] = H[j][k] + (j == k ? lambda*H[j][j] + 1e-12 : 0);
+			for(j = 0; j < nAct; j++)
+			{
+				for(k = 0; k <= j; k++)
+				{
+					s = A[j][k];
+					for(i = 0; i < k; i++)
+						s -= L[j][i]*L[k][i];
+					L[j][k] = (j == k) ? sqrt(s > 1e-30 ? s : 1e-30) : s/L[k][k];
+				}
+			}
+			for(j = 0; j < nAct; j++)
+			{
+				s = -b[j];
+				for(i = 0; i < j; i++)
+					s -= L[j][i]*x[i];
+				x[j] = s/L[j][j];
+			}
+			for(j = nAct-1; j >= 0; j--)
+			{
+				s = x[j];
+				for(i = j+1; i < nAct; i++)
+					s -= L[i][j]*x[i];
+				x[j] = s/L[j][j];
+			}
+			memset(xi, 0, sizeof(xi));
+			for(j = 0; j < nAct; j++)
+				xi[act[j]] = x[j];
+
+			// Apply the step: dR = exp(w), Rn = dR R0, tn = dR t0 + u
+			w = sqrt(xi[0]*xi[0] + xi[1]*xi[1] + xi[2]*xi[2]);
+			for(j = 0; j < 3; j++)
+				for(k = 0; k < 3; k++)
+					dR[j][k] = (j == k);
+			if(w > 0)
+			{
+				v[0] = xi[0]/w; v[1] = xi[1]/w; v[2] = xi[2]/w;
+				ct = cos(w); st = sin(w);
+				for(j = 0; j < 3; j++)
+					for(k = 0; k < 3; k++)
+						dR[j][k] = (j == k ? ct : 0) + (1-ct)*v[j]*v[k];
+				dR[0][1] -= v[2]*st; dR[0][2] += v[1]*st;
+				dR[1][0] += v[2]*st; dR[1][2] -= v[0]*st;
+				dR[2][0] -= v[1]*st; dR[2][1] += v[0]*st;
+			}
+			for(j = 0; j < 3; j++)
+			{
+				for(k = 0; k < 3; k++)
+					Rn[j][k] = dR[j][0]*R0[0][k] + dR[j][1]*R0[1][k] + dR[j][2]*R0[2][k];
+				qn[j] = dR[j][0]*t0[0] + dR[j][1]*t0[1] + dR[j][2]*t0[2];
+				tn[j] = registrationMode == REG_ROTATION_ONLY ? t0[j] : qn[j] + xi[3+j];
+			}
+
+			errorNew = DTRefineError(Rn, tn, refineDis[1], threshNew);
+			if(errorNew < error)
+			{
+				accepted = true;
+				lambda /= 10;
+			}
+			else
+				lambda *= 10;
+		}
+		localIterations ++;
+		if(!accepted)
+			break;
+
+		memcpy(R0, Rn, sizeof(R0));
+		memcpy(t0, tn, sizeof(t0));
+		tmp = refineDis[0]; refineDis[0] = refineDis[1]; refineDis[1] = tmp;
+		thresh = threshNew;
+		if(error - errorNew < icp3d.err_diff_def*inlierNum)
 		{
-			minDis[i] = dt.Distance(pDataTempICP[i].x, pDataTempICP[i].y, pDataTempICP[i].z);
+			error = errorNew;
+			break;
 		}
+		error = errorNew;
+	}
+
+	for(j = 0; j < 3; j++)
+	{
+		for(k = 0; k < 3; k++)
+			R.val[j][k] = R0[j][k];
+		t.val[j][0] = t0[j];
+	}
+
+	return error;
+}
+
+// Transform point cloud and use DT to determine the L2 error
+// dis is a scratch buffer of Nd floats, so that poses can be evaluated concurrently
+float GoICP::PoseError(const Matrix& R, const Matrix& t, float* dis)
+{
+	int i;
+	float error, x, y, z;
+
+	error = 0;
+	for(i = 0; i < Nd; i++)
+	{
+		POINT3D& p = pData[i];
+		x = R.val[0][0]*p.x + R.val[0][1]*p.y + R.val[0][2]*p.z + t.val[0][0];
+		y = R.val[1][0]*p.x + R.val[1][1]*p.y + R.val[1][2]*p.z + t.val[1][0];
+		z = R.val[2][0]*p.x + R.val[2][1]*p.y + R.val[2][2]*p.z + t.val[2][0];
+		dis[i] = registrationMode == REG_PLANAR ? dt2.Distance(x, y) : dt.Distance(x, y, z);
 	}
 
 	if(doTrim)
 	{
 		//qsort(minDis, Nd, sizeof(float), cmp);
 		//myqsort(minDis, Nd, inlierNum);
-		intro_select(minDis,0,Nd-1,inlierNum-1);
-		for(i = 0; i < inlierNum; i++)
+		intro_select(dis,0,Nd-1,inlierNum-1);
+	}
+	for(i = 0; i < inlierNum; i++)
+	{
+		error += dis[i]*dis[i];
+	}
+
+	return error;
+}
+
+// Determinant of a 3x3 matrix (Matrix::det() is not reliable, see ICP3D)
+static double Det3(const Matrix& M)
+{
+	return M.val[0][0]*(M.val[1][1]*M.val[2][2] - M.val[1][2]*M.val[2][1])
+		- M.val[0][1]*(M.val[1][0]*M.val[2][2] - M.val[1][2]*M.val[2][0])
+		+ M.val[0][2]*(M.val[1][0]*M.val[2][1] - M.val[1][1]*M.val[2][0]);
+}
+
+// Centroid and principal axes (columns, by decreasing variance) of a point cloud
+static void PrincipalAxes(const POINT3D* points, int n, Matrix& mu, Matrix& axes)
+{
+	int i, j, k;
+	float d[3];
+	Matrix C(3,3), W, V;
+
+	mu = Matrix(3,1);
+	for(i = 0; i < n; i++)
+	{
+		mu.val[0][0] += points[i].x;
+		mu.val[1][0] += points[i].y;
+		mu.val[2][0] += points[i].z;
+	}
+	mu = mu/(FLOAT)n;
+
+	for(i = 0; i < n; i++)
+	{
+		d[0] = points[i].x - mu.val[0][0];
+		d[1] = points[i].y - mu.val[1][0];
+		d[2] = points[i].z - mu.val[2][0];
+		for(j = 0; j < 3; j++)
+			for(k = 0; k < 3; k++)
+				C.val[j][k] += d[j]*d[k];
+	}
+	C.svd(axes, W, V);
+}
+
+// Starting poses of the multi-start ICP: the 4 proper rotations aligning the principal axes of
+// the data with those of the model, then multiStartCount rotations spread uniformly over SO(3)
+// (super-Fibonacci spiral). Each start is translated so that the centroids coincide.
+void GoICP::MultiStartPoses(vector<Matrix>& startR, vector<Matrix>& startT)
+{
+	int i, k;
+	double s, r1, r2, a, b, qw, qx, qy, qz, sign;
+	Matrix muM, muD, axesM, axesD;
+	Matrix R(3,3), S(3,3);
+
+	PrincipalAxes(pModel, Nm, muM, axesM);
+	PrincipalAxes(pData, Nd, muD, axesD);
+
+	// Principal axes are defined up to their signs, the third one follows from det(R) = 1
+	sign = Det3(axesM)*Det3(axesD) > 0 ? 1 : -1;
+	for(k = 0; k < 4; k++)
+	{
+		S = Matrix::eye(3);
+		S.val[0][0] = (k&1) ? -1 : 1;
+		S.val[1][1] = (k&2) ? -1 : 1;
+		S.val[2][2] = S.val[0][0]*S.val[1][1]*sign;
+		startR.push_back(axesM*S*~axesD);
+	}
+
+	for(i = 0; i < multiStartCount; i++)
+	{
+		s = i + 0.5;
+		r1 = sqrt(s/multiStartCount);
+		r2 = sqrt(1 - s/multiStartCount);
+		a = 2*PI*s/1.414213562373095;
+		b = 2*PI*s/1.533751168755204;
+		qx = r1*sin(a); qy = r1*cos(a);
+		qz = r2*sin(b); qw = r2*cos(b);
+
+		R.val[0][0] = 1 - 2*(qy*qy + qz*qz); R.val[0][1] = 2*(qx*qy - qz*qw);     R.val[0][2] = 2*(qx*qz + qy*qw);
+		R.val[1][0] = 2*(qx*qy + qz*qw);     R.val[1][1] = 1 - 2*(qx*qx + qz*qz); R.val[1][2] = 2*(qy*qz - qx*qw);
+		R.val[2][0] = 2*(qx*qz - qy*qw);     R.val[2][1] = 2*(qy*qz + qx*qw);     R.val[2][2] = 1 - 2*(qx*qx + qy*qy);
+		startR.push_back(R);
+	}
+
+	for(i = 0; i < (int)startR.size(); i++)
+		startT.push_back(muM - startR[i]*muD);
+}
+
+// Run ICP in parallel from the starting poses, within multiStartTime seconds (wall clock),
+// and make the best result the incumbent of the outer search
+void GoICP::MultiStartICP()
+{
+	int i, n, best, numRun, numTruncated, numThreads;
+	size_t iterations;
+	double timeBegin, elapsed, deadline;
+	vector<Matrix> startR, startT;
+
+	MultiStartPoses(startR, startT);
+	n = (int)startR.size();
+	vector<float> errors(n, -1);
+
+	timeBegin = WallTime();
+	deadline = multiStartTime > 0 ? timeBegin + multiStartTime : 0;
+	numTruncated = 0;
+#ifdef _OPENMP
+	numThreads = omp_get_max_threads();
+#else
+	numThreads = 1;
+#endif
+
+	#pragma omp parallel private(i, elapsed, iterations) reduction(+:numTruncated)
+	{
+		float * dis = (float*)malloc(sizeof(float)*Nd);
+		struct POINTREF * points = (struct POINTREF *)malloc(sizeof(struct POINTREF)*Nd);
+
+		#pragma omp for schedule(dynamic)
+		for(i = 0; i < n; i++)
 		{
-			error += minDis[i]*minDis[i];
+			// Starts left over when the time budget runs out are skipped
+			elapsed = WallTime() - timeBegin;
+			if(multiStartTime > 0 && elapsed > multiStartTime)
+				continue;
+
+			// Runs still going at the end of the budget are stopped there, and their poses discarded
+			icp3d.Run(D_icp, Nd, startR[i], startT[i], points, deadline, iterations);
+			if(deadline > 0 && iterations >= icp3d.max_iter_def && WallTime() > deadline)
+			{
+				numTruncated ++;
+				continue;
+			}
+			errors[i] = PoseError(startR[i], startT[i], dis);
 		}
+
+		free(dis);
+		free(points);
 	}
 
-	return error;
+	elapsed = WallTime() - timeBegin;
+
+	best = -1;
+	numRun = 0;
+	for(i = 0; i < n; i++)
+	{
+		if(errors[i] < 0)
+			continue;
+		numRun ++;
+		if(best < 0 || errors[i] < errors[best])
+			best = i;
+	}
+
+	cout << "Multi-start ICP: " << numRun << " of " << n << " starts in " << elapsed << "s (" << numThreads << " threads)";
+	if(numTruncated > 0)
+		cout << ", " << numTruncated << " stopped by the time budget";
+	if(best >= 0)
+		cout << ", best error " << errors[best];
+	cout << endl;
+
+	if(best >= 0 && errors[best] < optError)
+	{
+		optError = errors[best];
+		optR = startR[best];
+		optT = startT[best];
+		cout << "Error*: " << optError << " (multi-start ICP)" << endl;
+	}
 }
 
 void GoICP::Initialize()
 {
 	int i, j;
-	float sigma, maxAngle;
+	float sigma, maxAngle, maxNorm, dtRes;
+	ROTNODE cell;
 
-	// Precompute the rotation uncertainty distance (maxRotDis) for each point in the data and each level of rotation subcube
+	// Checked first, the norms and rotation levels below depend on the rotation domain
+	if(rotDomain < ROTDOMAIN_ANGLEAXIS || rotDomain > ROTDOMAIN_YAW)
+		rotDomain = ROTDOMAIN_ANGLEAXIS;
 
-	// Calculate L2 norm of each point in data cloud to origin
-	normData = (float*)malloc(sizeof(float)*Nd);
-	for(i = 0; i < Nd; i++)
+	// The planar mode searches the yaw interval and the xy square of the translation domain.
+	// Its translation squares are centred on z = 0.
+	if(registrationMode == REG_PLANAR)
 	{
-		normData[i] = sqrt(pData[i].x*pData[i].x + pData[i].y*pData[i].y + pData[i].z*pData[i].z);
+		rotDomain = ROTDOMAIN_YAW;
+		initNodeTrans.z = -initNodeTrans.w/2;
+		dataClusterLevels = 0; // cluster bounds look up the 3D DT
 	}
 
-	maxRotDis = new float*[MAXROTLEVEL];
-	for(i = 0; i < MAXROTLEVEL; i++)
+	// Subset-first lower bounds are only valid without trimming, where the error is a sum of non-negative terms
+	if(!doTrim && lbSubsetSize > 0 && lbSubsetSize < Nd)
+		subsetNum = lbSubsetSize;
+	else
+		subsetNum = 0;
+
+	// Bounds are evaluated on the data points in stratified order (see StratifyData)
+	dataOrder = (int*)malloc(sizeof(int)*Nd);
+	StratifyData();
+
+	// Calculate L2 norm of each point in data cloud to origin, and its distance to the rotation
+	// axis which scales its rotation uncertainty
+	normData = (float*)malloc(sizeof(float)*Nd);
+	rotNormData = (float*)malloc(sizeof(float)*Nd);
+	maxNorm = 0;
+	maxNormIdx = 0;
+	maxDataNorm = 0;
+	for(i = 0; i < Nd; i++)
 	{
-		maxRotDis[i] = (float*)malloc(sizeof(float*)*Nd);
+		POINT3D& p = pData[dataOrder[i]];
+		normData[i] = sqrt(p.x*p.x + p.y*p.y + p.z*p.z);
+		rotNormData[i] = rotDomain == ROTDOMAIN_YAW ? sqrt(p.x*p.x + p.y*p.y) : normData[i];
+		if(normData[i] > maxDataNorm)
+			maxDataNorm = normData[i];
+		if(rotNormData[i] > maxNorm)
+		{
+			maxNorm = rotNormData[i];
+			maxNormIdx = i;
+		}
+	}
 
-		sigma = initNodeRot.w/pow(2.0,i)/2.0; // Half-side length of each level of rotation subcube
-		maxAngle = SQRT3*sigma;
+	BuildClusters();
 
-		if(maxAngle > PI)
-			maxAngle = PI;
-		for(j = 0; j < Nd; j++)
-			maxRotDis[i][j] = 2*sin(maxAngle/2)*normData[j];
+	// Find the deepest rotation level worth subdividing to. Once the rotation uncertainty
+	// radius of the farthest data point drops below the DT quantization error, further
+	// subdivision cannot sharpen the bounds and only multiplies work.
+	if(registrationMode == REG_PLANAR)
+		dtRes = SQRT2/2.0/dt2.scale;
+	else
+		dtRes = SQRT3/2.0/dt.scale;
+	for(maxRotLevel = 0; maxRotLevel < MAXROTLEVEL; maxRotLevel++)
+	{
+		if(rotDomain == ROTDOMAIN_QUAT)
+		{
+			// The cells at the centre of a face span the widest angles
+			cell.f = 0;
+			cell.w = 2.0/pow(2.0,maxRotLevel);
+			cell.a = cell.b = cell.c = -cell.w/2;
+			maxAngle = RotCellAngle(cell);
+		}
+		else if(rotDomain == ROTDOMAIN_YAW)
+		{
+			maxAngle = min((float)(initNodeRot.w/pow(2.0,maxRotLevel)/2.0), (float)PI);
+		}
+		else
+		{
+			sigma = initNodeRot.w/pow(2.0,maxRotLevel)/2.0;
+			maxAngle = SQRT3*sigma;
+			if(maxAngle > PI)
+				maxAngle = PI;
+		}
+		if(2*sin(maxAngle/2)*maxNorm <= dtRes)
+			break;
 	}
 
+	// The rotation uncertainty distance (maxRotDis) for each level is computed on demand
+	maxRotDis.clear();
+	nodeRotDis = rotDomain == ROTDOMAIN_QUAT ? (float*)malloc(sizeof(float)*Nd) : NULL;
+
 	// Temporary Variables
 	minDis = (float*)malloc(sizeof(float)*Nd);
+	minDis8 = (float*)malloc(sizeof(float)*Nd*8);
+	lbDis8 = (transBoxBound || rotDomain == ROTDOMAIN_YAW) ? (float*)malloc(sizeof(float)*Nd*8) : NULL;
 	pDataTemp = (POINT3D *)malloc(sizeof(POINT3D)*Nd);
-	pDataTempICP = (POINT3D *)malloc(sizeof(POINT3D)*Nd);
+	asyncDis = (float*)malloc(sizeof(float)*Nd);
+	refineDis[0] = refineDis[1] = NULL;
+	if(localOptimizer == LOCAL_DT_LM)
+	{
+		refineDis[0] = (float*)malloc(sizeof(float)*Nd);
+		refineDis[1] = (float*)malloc(sizeof(float)*Nd);
+	}
 
 	// ICP Initialisation
 	// Copy model and data point clouds to variables for ICP
 	M_icp = (float*)calloc(3*Nm,sizeof(float));
 	D_icp = (float*)calloc(3*Nd,sizeof(float));
+	// (projected onto the xy plane in the planar mode)
 	for(i = 0, j = 0; i < Nm; i++)
 	{
 		M_icp[j++] = pModel[i].x;
 		M_icp[j++] = pModel[i].y;
-		M_icp[j++] = pModel[i].z;
+		M_icp[j++] = registrationMode == REG_PLANAR ? 0 : pModel[i].z;
+	}
+	// The coarse ICP stages run on prefixes of the data, which a fixed random order makes
+	// representative subsets (the ICP result does not depend on the order)
+	vector<int> icpOrder(Nd);
+	for(i = 0; i < Nd; i++)
+		icpOrder[i] = i;
+	if(icpCoarseStages > 0)
+	{
+		unsigned int seed = 1;
+		for(i = Nd-1; i > 0; i--)
+		{
+			seed = seed*1103515245 + 12345;
+			swap(icpOrder[i], icpOrder[(seed >> 8) % (i+1)]);
+		}
 	}
 	for(i = 0, j = 0; i < Nd; i++)
 	{
-		D_icp[j++] = pData[i].x;
-		D_icp[j++] = pData[i].y;
-		D_icp[j++] = pData[i].z;
+		D_icp[j++] = pData[icpOrder[i]].x;
+		D_icp[j++] = pData[icpOrder[i]].y;
+		D_icp[j++] = registrationMode == REG_PLANAR ? 0 : pData[icpOrder[i]].z;
 	}
 
 	// Build ICP kdtree with model dataset
+	icp3d.point_to_plane = icpPointToPlane && registrationMode == REG_FULL;
+	icp3d.warm_start = icpWarmStart;
+	icp3d.coarse_stages = icpCoarseStages;
+	icp3d.time_limit = icpTimeBudget;
 	icp3d.Build(M_icp,Nm);
 	icp3d.err_diff_def = MSEThresh/10000;
 	icp3d.trim_fraction = trimFraction;
 	icp3d.do_trim = doTrim;
+	icp3d.cpt_grid = NULL;
+	if(icpClosestPoint != ICP_NN_KDTREE && dt.ClosestPointGrid() != NULL)
+	{
+		cptGrid.index = dt.ClosestPointGrid();
+		cptGrid.size = dt.SIZE;
+		cptGrid.xMin = dt.xMin;
+		cptGrid.yMin = dt.yMin;
+		cptGrid.zMin = dt.zMin;
+		cptGrid.scale = dt.scale;
+		icp3d.cpt_grid = &cptGrid;
+		icp3d.cpt_exact_final = icpClosestPoint == ICP_NN_GRID_EXACT;
+	}
 
 	// Initialise so-far-best rotation and translation nodes
 	optNodeRot = initNodeRot;
@@ -167,6 +947,37 @@ void GoICP::Initialize()
 	// Initialise so-far-best rotation and translation matrices
 	optR = Matrix::eye(3);
 	optT = Matrix::ones(3,1)*0;
+	if(registrationMode == REG_ROTATION_ONLY)
+		optT = fixedT;
+	else if(registrationMode == REG_TRANSLATION_ONLY)
+		optR = fixedR;
+
+	rotNodeCount = 0;
+	transNodeCount = 0;
+	rotUBCount = 0;
+	rotLBCount = 0;
+	rotUBTime = 0;
+	rotLBTime = 0;
+	rotSubsetPruned = 0;
+	transSubsetPruned = 0;
+	transClusterPruned = 0;
+	transShellPruned = 0;
+	rotOutsideCount = 0;
+	localCount = 0;
+	localIterations = 0;
+	localTime = 0;
+	icpCache.clear();
+	icpCacheIndex.clear();
+	icpCacheLookups = icpCacheHits = 0;
+	icpRefined = icpSkipped = icpTruncated = 0;
+	icpIterCap = icp3d.max_iter_def;
+	if(rotSearchMode < SEARCH_BEST_BOUND || rotSearchMode > SEARCH_BEST_UB)
+		rotSearchMode = SEARCH_BEST_BOUND;
+	if(transSearchMode < SEARCH_BEST_BOUND || transSearchMode > SEARCH_BEST_UB)
+		transSearchMode = SEARCH_BEST_BOUND;
+	memset(&rotSearchStats, 0, sizeof(SEARCHSTATS));
+	memset(&transSearchStats, 0, sizeof(SEARCHSTATS));
+	shellCache.clear();
 
 	// For untrimmed ICP, use all points, otherwise only use inlierNum points
 	if(doTrim)
@@ -184,104 +995,801 @@ void GoICP::Initialize()
 void GoICP::Clear()
 {
 	delete(pDataTemp);
-	delete(pDataTempICP);
 	delete(normData);
+	free(rotNormData);
+	free(dataOrder);
 	delete(minDis);
-	for(int i = 0; i < MAXROTLEVEL; i++)
+	free(minDis8);
+	free(asyncDis);
+	if(lbDis8)
+		free(lbDis8);
+	for(int i = 0; i < (int)maxRotDis.size(); i++)
 	{
-		delete(maxRotDis[i]);
+		if(maxRotDis[i])
+			free(maxRotDis[i]);
+	}
+	maxRotDis.clear();
+	if(nodeRotDis)
+		free(nodeRotDis);
+	if(refineDis[0])
+	{
+		free(refineDis[0]);
+		free(refineDis[1]);
 	}
-	delete(maxRotDis);
 	delete(M_icp);
 	delete(D_icp);
 }
 
+// Order the data points so that every prefix of dataOrder is spatially stratified
+// Points are bucketed into a voxel grid and the buckets are visited round-robin,
+// i.e. sorted by (rank within bucket, bucket)
+void GoICP::StratifyData()
+{
+	int i, g, cx, cy, cz, cell;
+	float xMin, xMax, yMin, yMax, zMin, zMax, ext;
+
+	// Bounds over the full data do not depend on the order
+	if(subsetNum == 0)
+	{
+		for(i = 0; i < Nd; i++)
+			dataOrder[i] = i;
+		return;
+	}
+
+	xMin = xMax = pData[0].x;
+	yMin = yMax = pData[0].y;
+	zMin = zMax = pData[0].z;
+	for(i = 1; i < Nd; i++)
+	{
+		if(xMin > pData[i].x) xMin = pData[i].x;
+		if(xMax < pData[i].x) xMax = pData[i].x;
+		if(yMin > pData[i].y) yMin = pData[i].y;
+		if(yMax < pData[i].y) yMax = pData[i].y;
+		if(zMin > pData[i].z) zMin = pData[i].z;
+		if(zMax < pData[i].z) zMax = pData[i].z;
+	}
+	ext = xMax-xMin > yMax-yMin ? xMax-xMin : yMax-yMin;
+	ext = ext > zMax-zMin ? ext : zMax-zMin;
+	if(ext <= 0)
+		ext = 1;
+
+	// Surfaces occupy roughly g^2 of the g^3 cells, aim for a few cells per subset point
+	g = (int)ceil(2*sqrt((double)subsetNum));
+	if(g > 64)
+		g = 64;
+
+	vector<int> cellCount(g*g*g, 0);
+	vector<pair<long long, int> > keys(Nd);
+	for(i = 0; i < Nd; i++)
+	{
+		cx = (int)((pData[i].x-xMin)/ext*(g-1) + 0.5);
+		cy = (int)((pData[i].y-yMin)/ext*(g-1) + 0.5);
+		cz = (int)((pData[i].z-zMin)/ext*(g-1) + 0.5);
+		cell = (cz*g + cy)*g + cx;
+		keys[i].first = (long long)(cellCount[cell]++)*g*g*g + cell;
+		keys[i].second = i;
+	}
+	sort(keys.begin(), keys.end());
+
+	for(i = 0; i < Nd; i++)
+		dataOrder[i] = keys[i].second;
+}
+
+// Build an octree of data point clusters, level k having 2^(k+1) cells along each axis
+// Member indices refer to the stratified order, like normData and pDataTemp
+void GoICP::BuildClusters()
+{
+	int i, k, g, n, cx, cy, cz, st;
+	float xMin, yMin, zMin, xMax, yMax, zMax, ext, dx, dy, dz, r;
+	double sx, sy, sz;
+	DATACLUSTER cluster;
+
+	clusters.clear();
+	clusterRadius.clear();
+	clusterTemp.clear();
+	clusterRotated.clear();
+
+	if(dataClusterLevels <= 0)
+		return;
+
+	xMin = xMax = pData[0].x;
+	yMin = yMax = pData[0].y;
+	zMin = zMax = pData[0].z;
+	for(i = 1; i < Nd; i++)
+	{
+		if(xMin > pData[i].x) xMin = pData[i].x;
+		if(xMax < pData[i].x) xMax = pData[i].x;
+		if(yMin > pData[i].y) yMin = pData[i].y;
+		if(yMax < pData[i].y) yMax = pData[i].y;
+		if(zMin > pData[i].z) zMin = pData[i].z;
+		if(zMax < pData[i].z) zMax = pData[i].z;
+	}
+	ext = xMax-xMin > yMax-yMin ? xMax-xMin : yMax-yMin;
+	ext = ext > zMax-zMin ? ext : zMax-zMin;
+	if(ext <= 0)
+		ext = 1;
+
+	vector< pair<long long, int> > keys(Nd);
+	for(k = 0; k < dataClusterLevels && k < MAXCLUSTERLEVEL; k++)
+	{
+		g = 2 << k;
+		for(i = 0; i < Nd; i++)
+		{
+			POINT3D& p = pData[dataOrder[i]];
+			cx = (int)((p.x-xMin)/ext*g); if(cx >= g) cx = g-1;
+			cy = (int)((p.y-yMin)/ext*g); if(cy >= g) cy = g-1;
+			cz = (int)((p.z-zMin)/ext*g); if(cz >= g) cz = g-1;
+			keys[i].first = ((long long)cz*g + cy)*g + cx;
+			keys[i].second = i;
+		}
+		sort(keys.begin(), keys.end());
+
+		clusters.push_back(vector<DATACLUSTER>());
+		clusterRadius.push_back(0);
+		for(st = 0; st < Nd; st += n)
+		{
+			// Points of one cell are contiguous after sorting
+			sx = sy = sz = 0;
+			cluster.far = keys[st].second;
+			for(n = 0; st+n < Nd && keys[st+n].first == keys[st].first; n++)
+			{
+				i = keys[st+n].second;
+				POINT3D& p = pData[dataOrder[i]];
+				sx += p.x; sy += p.y; sz += p.z;
+				if(rotNormData[i] > rotNormData[cluster.far])
+					cluster.far = i;
+			}
+			cluster.n = n;
+			cluster.c.x = sx/n;
+			cluster.c.y = sy/n;
+			cluster.c.z = sz/n;
+
+			cluster.r = 0;
+			for(i = st; i < st+n; i++)
+			{
+				POINT3D& p = pData[dataOrder[keys[i].second]];
+				dx = p.x-cluster.c.x; dy = p.y-cluster.c.y; dz = p.z-cluster.c.z;
+				r = sqrt(dx*dx + dy*dy + dz*dz);
+				if(r > cluster.r)
+					cluster.r = r;
+			}
+			if(cluster.r > clusterRadius[k])
+				clusterRadius[k] = cluster.r;
+
+			clusters[k].push_back(cluster);
+		}
+
+		clusterTemp.push_back(vector<POINT3D>(clusters[k].size()));
+		clusterRotated.push_back(false);
+	}
+}
+
+// Coarsest cluster level whose clusters are small compared to the given uncertainty radius,
+// or -1 if the points themselves should be used
+int GoICP::ClusterLevel(float uncertainty)
+{
+	int k;
+	for(k = 0; k < (int)clusters.size(); k++)
+	{
+		if(clusterRadius[k] <= CLUSTER_RADIUS_RATIO*uncertainty)
+		{
+			// Not worth it if the clusters hardly outnumber the points
+			if(4*(int)clusters[k].size() > Nd)
+				return -1;
+			return k;
+		}
+	}
+	return -1;
+}
+
+// Lower bounds of the 8 translation subcubes from the clusters of level c
+// For a member x of a cluster with centroid m and radius r, |R0*x + t0 - y| >= |R0*m + t0 - y| - r,
+// and the rotation uncertainty of the member with the largest norm covers all of them
+void GoICP::ClusterLB(int c, float* maxRotDisL, float maxTransDis, const float* transX, const float* transY, const float* transZ, float* lbs)
+{
+	int q, j, nc, cnt;
+	float dis, rotDis;
+
+	vector<DATACLUSTER>& cl = clusters[c];
+	vector<POINT3D>& ct = clusterTemp[c];
+	nc = (int)cl.size();
+
+	// Rotate the centroids of this level on first use after RotateData
+	if(!clusterRotated[c])
+	{
+		for(q = 0; q < nc; q++)
+		{
+			POINT3D& p = cl[q].c;
+			ct[q].x = dataRot[0][0]*p.x + dataRot[0][1]*p.y + dataRot[0][2]*p.z;
+			ct[q].y = dataRot[1][0]*p.x + dataRot[1][1]*p.y + dataRot[1][2]*p.z;
+			ct[q].z = dataRot[2][0]*p.x + dataRot[2][1]*p.y + dataRot[2][2]*p.z;
+		}
+		clusterRotated[c] = true;
+	}
+
+	if(doTrim)
+		clusterTerms.resize(8*nc);
+
+	for(j = 0; j < 8; j++)
+		lbs[j] = 0;
+
+	for(q = 0; q < nc; q++)
+	{
+		rotDis = maxRotDisL ? maxRotDisL[cl[q].far] : 0;
+		for(j = 0; j < 8; j++)
+		{
+			dis = dt.Distance(ct[q].x + transX[j], ct[q].y + transY[j], ct[q].z + transZ[j]) - rotDis - cl[q].r - maxTransDis;
+			if(dis < 0)
+				dis = 0;
+			if(doTrim)
+				clusterTerms[j*nc+q] = make_pair(dis, cl[q].n);
+			else
+				lbs[j] += cl[q].n*dis*dis;
+		}
+	}
+
+	// With trimming, the inlierNum smallest member bounds bound the inlierNum smallest distances
+	if(doTrim)
+	{
+		for(j = 0; j < 8; j++)
+		{
+			sort(clusterTerms.begin()+j*nc, clusterTerms.begin()+(j+1)*nc);
+			for(q = 0, cnt = 0; q < nc && cnt < inlierNum; q++)
+			{
+				pair<float,int>& term = clusterTerms[j*nc+q];
+				int m = min(term.second, inlierNum-cnt);
+				lbs[j] += m*term.first*term.first;
+				cnt += m;
+			}
+		}
+	}
+}
+
+// Rotation-invariant lower bound of a translation cube (shell bound), cached per cube
+// For any rotation, a data point x translated within the cube lies in the shell of radii |x| -+ d
+// around the cube centre c, d being its half diagonal. Its distance to the model is thus at least
+// the gap between |x| and the radii |y-c| of the model points, minus d.
+float GoICP::ShellLB(const TRANSNODE& node)
+{
+	int i, b, lo, hi, numBins, level;
+	float cx, cy, cz, dx, dy, dz, r, rMax, binW, dis, error;
+	pair<int, long long> key;
+
+	// Translation cubes come from the same octree in every inner search
+	level = (int)floor(log(initNodeTrans.w/node.w)/log(2.0) + 0.5);
+	if(level > 20)
+		return 0;
+	key.first = level;
+	// Cube coordinates are below 2^20 at these levels, 21 bits each
+	key.second = ((long long)floor((node.x-initNodeTrans.x)/node.w + 0.5) << 42)
+		| ((long long)floor((node.y-initNodeTrans.y)/node.w + 0.5) << 21)
+		| (long long)floor((node.z-initNodeTrans.z)/node.w + 0.5);
+	map<pair<int, long long>, float>::iterator it = shellCache.find(key);
+	if(it != shellCache.end())
+		return it->second;
+
+	cx = node.x + node.w/2;
+	cy = node.y + node.w/2;
+	cz = node.z + node.w/2;
+
+	// Occupancy of the model radii around the cube centre, in bins of one DT voxel
+	binW = 1.0/dt.scale;
+	rMax = 0;
+	for(i = 0; i < Nm; i++)
+	{
+		dx = pModel[i].x-cx; dy = pModel[i].y-cy; dz = pModel[i].z-cz;
+		r = sqrt(dx*dx + dy*dy + dz*dz);
+		if(r > rMax)
+			rMax = r;
+	}
+	numBins = (int)(rMax/binW) + 1;
+	vector<int> lowerBin(numBins, -1), upperBin(numBins, numBins);
+	for(i = 0; i < Nm; i++)
+	{
+		dx = pModel[i].x-cx; dy = pModel[i].y-cy; dz = pModel[i].z-cz;
+		b = (int)(sqrt(dx*dx + dy*dy + dz*dz)/binW);
+		if(b >= numBins)
+			b = numBins-1;
+		lowerBin[b] = upperBin[b] = b;
+	}
+	// Nearest occupied bin at or below / at or above each bin
+	for(b = 1; b < numBins; b++)
+		if(lowerBin[b] < 0)
+			lowerBin[b] = lowerBin[b-1];
+	for(b = numBins-2; b >= 0; b--)
+		if(upperBin[b] >= numBins)
+			upperBin[b] = upperBin[b+1];
+
+	// Leave room for the DT quantization error, the bound is compared with DT values
+	for(i = 0; i < Nd; i++)
+	{
+		r = normData[i];
+		b = (int)(r/binW);
+		if(b >= numBins)
+		{
+			dis = r - rMax;
+		}
+		else
+		{
+			lo = lowerBin[b];
+			hi = upperBin[b];
+			if(lo == b)
+				dis = 0;
+			else
+			{
+				dis = lo >= 0 ? r - (lo+1)*binW : r;
+				if(hi < numBins && hi*binW - r < dis)
+					dis = hi*binW - r;
+			}
+		}
+		dis -= SQRT3/2.0*node.w + SQRT3/2.0/dt.scale;
+		minDis[i] = dis > 0 ? dis : 0;
+	}
+
+	if(doTrim)
+	{
+		intro_select(minDis,0,Nd-1,inlierNum-1);
+	}
+
+	error = 0;
+	for(i = 0; i < inlierNum; i++)
+	{
+		error += minDis[i]*minDis[i];
+	}
+
+	shellCache[key] = error;
+	return error;
+}
+
+// Rotation uncertainty distance of each data point at rotation level l
+// The table grows as the search reaches deeper levels
+float* GoICP::RotDisAtLevel(int l)
+{
+	int j;
+	float sigma, maxAngle;
+
+	if((int)maxRotDis.size() <= l)
+		maxRotDis.resize(l+1, NULL);
+
+	if(maxRotDis[l] == NULL)
+	{
+		maxRotDis[l] = (float*)malloc(sizeof(float)*Nd);
+
+		sigma = initNodeRot.w/pow(2.0,l)/2.0; // Half-side length of each level of rotation subcube
+		// A yaw interval is one-dimensional, and only moves points around the z axis
+		maxAngle = rotDomain == ROTDOMAIN_YAW ? sigma : SQRT3*sigma;
+
+		if(maxAngle > PI)
+			maxAngle = PI;
+		for(j = 0; j < Nd; j++)
+			maxRotDis[l][j] = 2*sin(maxAngle/2)*rotNormData[j];
+	}
+
+	return maxRotDis[l];
+}
+
+// Largest rotation angle between the centre of a rotation node and any rotation in it
+float GoICP::RotCellAngle(const ROTNODE& nodeRot)
+{
+	int k;
+	float c[3], v[3], cc, cv, vv, cosAngle, minCos;
+
+	if(rotDomain == ROTDOMAIN_YAW)
+		return min((float)(nodeRot.w/2), (float)PI);
+	if(rotDomain != ROTDOMAIN_QUAT)
+		return min((float)(SQRT3*nodeRot.w/2), (float)PI);
+
+	// A face cell is the cube (a,b,c)+[0,w]^3 in the hyperplane q_f = 1, its quaternions are the
+	// normalized points. The angle of a point to the centre is quasiconvex over the cube, hence
+	// largest at a vertex, and the rotation angle is twice the angle between the quaternions.
+	c[0] = nodeRot.a + nodeRot.w/2;
+	c[1] = nodeRot.b + nodeRot.w/2;
+	c[2] = nodeRot.c + nodeRot.w/2;
+	cc = 1 + c[0]*c[0] + c[1]*c[1] + c[2]*c[2];
+	minCos = 1;
+	for(k = 0; k < 8; k++)
+	{
+		v[0] = nodeRot.a + (k&1)*nodeRot.w;
+		v[1] = nodeRot.b + (k>>1&1)*nodeRot.w;
+		v[2] = nodeRot.c + (k>>2&1)*nodeRot.w;
+		cv = 1 + c[0]*v[0] + c[1]*v[1] + c[2]*v[2];
+		vv = 1 + v[0]*v[0] + v[1]*v[1] + v[2]*v[2];
+		cosAngle = cv/sqrt(cc*vv);
+		if(cosAngle < minCos)
+			minCos = cosAngle;
+	}
+	if(minCos <= 0)
+		return PI;
+	return min((float)(2*acos(minCos)), (float)PI);
+}
+
+// Rotation uncertainty distance of each data point over a quaternion face cell, whose
+// angular radius depends on its position on the face and not only on its level
+float* GoICP::RotDisAtCell(const ROTNODE& nodeRot)
+{
+	int i;
+	float ratio;
+
+	ratio = 2*sin(RotCellAngle(nodeRot)/2);
+	for(i = 0; i < Nd; i++)
+		nodeRotDis[i] = ratio*normData[i];
+
+	return nodeRotDis;
+}
+
+// Finish off a rotation node at maxRotLevel with local refinement instead of subdividing it
+void GoICP::RefineLeaf(const Matrix& R_leaf, const Matrix& t_leaf)
+{
+	float error;
+	double timeBeginICP;
+
+	Matrix R_icp = R_leaf;
+	Matrix t_icp = t_leaf;
+
+	if(asyncRunning)
+	{
+		AsyncICPPost(R_icp, t_icp, PoseError(R_icp, t_icp, minDis));
+		return;
+	}
+
+	timeBeginICP = WallTime();
+	error = ICP(R_icp, t_icp);
+	if(error < optError)
+	{
+		optError = error;
+		optR = R_icp;
+		optT = t_icp;
+
+		cout << "Error*: " << error << "(Leaf ICP " << (WallTime() - timeBeginICP) << "s)" << endl;
+	}
+}
+
+// Error of the first n rotated data points (pDataTemp) under a single translation
+// With maxRotDisL != NULL, the rotation uncertainty radius is subtracted as in InnerBnB
+float GoICP::TransError(float* maxRotDisL, const POINT3D& trans, int n)
+{
+	int i;
+	float error;
+
+	for(i = 0; i < n; i++)
+	{
+		if(registrationMode == REG_PLANAR)
+			minDis[i] = dt2.Distance(pDataTemp[i].x + trans.x, pDataTemp[i].y + trans.y);
+		else
+			minDis[i] = dt.Distance(pDataTemp[i].x + trans.x, pDataTemp[i].y + trans.y, pDataTemp[i].z + trans.z);
+		if(maxRotDisL)
+			minDis[i] -= maxRotDisL[i];
+		if(minDis[i] < 0)
+			minDis[i] = 0;
+	}
+
+	if(doTrim)
+	{
+		intro_select(minDis,0,Nd-1,inlierNum-1);
+	}
+
+	error = 0;
+	for(i = 0; i < (doTrim ? inlierNum : n); i++)
+	{
+		error += minDis[i]*minDis[i];
+	}
+
+	return error;
+}
+
 // Inner Branch-and-Bound, iterating over the translation space
-float GoICP::InnerBnB(float* maxRotDisL, TRANSNODE* nodeTransOut)
+// transSeeds are candidate translations (e.g. the best one of the parent rotation node)
+// evaluated before the search to start from a tight optErrorT
+// With subsetOnly, only the stratified subset of the data is used, which gives a lower bound of the full search
+float GoICP::InnerBnB(float* maxRotDisL, TRANSNODE* nodeTransOut, const POINT3D* transSeeds, int numSeeds, bool subsetOnly)
 {
-	int i, j;
-	float transX, transY, transZ;
-	float lb, ub, optErrorT;
-	float dis, maxTransDis;
-	TRANSNODE nodeTrans, nodeTransParent;
-	priority_queue<TRANSNODE> queueTrans;
+	if(registrationMode == REG_PLANAR)
+		return InnerBnBKernel<2>(maxRotDisL, nodeTransOut, transSeeds, numSeeds, subsetOnly);
+	return InnerBnBKernel<3>(maxRotDisL, nodeTransOut, transSeeds, numSeeds, subsetOnly);
+}
+
+// The translation search over DIM dimensions: octrees on the 3D DT, quadtrees on the 2D DT of
+// the planar mode. Planar translation squares are centred on z = 0 (z = -w/2), and the cluster,
+// shell and box bounds, which look up the 3D DT, are only used with DIM = 3.
+template <int DIM>
+float GoICP::InnerBnBKernel(float* maxRotDisL, TRANSNODE* nodeTransOut, const POINT3D* transSeeds, int numSeeds, bool subsetOnly)
+{
+	const int NCHILD = 1 << DIM;
+	int i, j, k, c, nPts, nFirst, nAlive, boxLevel;
+	int alive[8];
+	long long expansions, pops;
+	bool pruned[8], useShell, diving, haveDive, boundPop;
+	float shellLbs[8];
+	float transX[8], transY[8], transZ[8];
+	float ubs[8], lbs[8];
+	float lb, ub, optErrorT, optErrorTParent, shellLb;
+	float dis, lbDis, boxDis, rotDis, maxTransDis, transDis, halfW;
+	float * dis8;
+	bool yawRadius, ownLb;
+	TRANSNODE nodeTrans, nodeTransParent, nodeTransDive;
+	NODEORDER<TRANSNODE> transOrder(transSearchMode), diveOrder(SEARCH_BEST_UB);
+	TRANSQUEUE queueTrans(transOrder);
 
 	// Set optimal translation error to overall so-far optimal error
 	// Investigating translation nodes that are sub-optimal overall is redundant
 	optErrorT = optError;
 
+	// Without trimming, bounds over the first subsetNum points are lower bounds of the full ones.
+	// Subcubes are first bounded on that subset, and only the survivors are completed on the rest.
+	nPts = subsetOnly ? subsetNum : Nd;
+	nFirst = (!subsetOnly && subsetNum > 0) ? subsetNum : nPts;
+
+	// A yaw rotation moves the points horizontally only, so the rotation uncertainty disc and the
+	// translation cube add up to at most sqrt((rotDis + SQRT2*w/2)^2 + (w/2)^2) < rotDis + SQRT3*w/2
+	yawRadius = DIM == 3 && rotDomain == ROTDOMAIN_YAW && maxRotDisL != NULL;
+
+	// At coarse rotation levels, the per-point bounds collapse to zero while the rotation-invariant
+	// shell bound of a translation cube does not. It bounds every translation in the cube, so the
+	// bounds of the cubes are raised to it.
+	useShell = DIM == 3 && shellBoundFactor > 0 && maxRotDisL != NULL && !subsetOnly
+		&& maxRotDisL[maxNormIdx] >= shellBoundFactor*normData[maxNormIdx];
+	shellLb = 0;
+	if(useShell)
+	{
+		shellLb = ShellLB(initNodeTrans);
+		if(shellLb >= optErrorT)
+		{
+			transShellPruned ++;
+			return optErrorT;
+		}
+	}
+
+	// Warm start from the seed translations
+	for(j = 0; j < numSeeds; j++)
+	{
+		ub = TransError(maxRotDisL, transSeeds[j], nPts);
+		if(ub < shellLb)
+			ub = shellLb;
+		if(ub < optErrorT)
+		{
+			optErrorT = ub;
+			if(nodeTransOut)
+			{
+				nodeTransOut->x = transSeeds[j].x;
+				nodeTransOut->y = transSeeds[j].y;
+				nodeTransOut->z = transSeeds[j].z;
+				nodeTransOut->w = 0;
+			}
+		}
+	}
+
 	// Push top-level translation node into the priority queue
 	queueTrans.push(initNodeTrans);
 
 	//
+	diving = false;
+	haveDive = false;
+	boundPop = false;
+	expansions = 0;
+	pops = 0;
 	while(1)
 	{
-		if(queueTrans.empty())
-			break;
+		// A dive goes on with the most promising child of the last expanded node
+		if(haveDive)
+		{
+			nodeTransParent = nodeTransDive;
+			haveDive = false;
+		}
+		else
+		{
+			if(queueTrans.empty())
+				break;
 
-		nodeTransParent = queueTrans.top();
-		queueTrans.pop();
+			// Lowest upper bound first still takes the lowest lower bound every diveInterval pops
+			boundPop = transSearchMode == SEARCH_BEST_UB && ++pops % (diveInterval > 0 ? diveInterval : BOUND_POP_INTERVAL) == 0;
+			if(boundPop)
+			{
+				transSearchStats.boundPops ++;
+				nodeTransParent = queueTrans.topBound();
+				queueTrans.popBound();
+			}
+			else
+			{
+				nodeTransParent = queueTrans.top();
+				queueTrans.pop();
+			}
+			diving = false;
+		}
 
 		if(optErrorT-nodeTransParent.lb < SSEThresh)
 		{
+			// Only a node popped in best-bound order has the lowest lower bound of all
+			if(diving || (transSearchMode == SEARCH_BEST_UB && !boundPop))
+			{
+				transSearchStats.epsPruned ++;
+				continue;
+			}
 			break;
 		}
 
+		if(diving)
+			transSearchStats.diveNodes ++;
+		else if(transSearchMode == SEARCH_DIVES && ++expansions % (diveInterval > 0 ? diveInterval : DIVE_INTERVAL) == 0)
+		{
+			diving = true;
+			transSearchStats.dives ++;
+		}
+		optErrorTParent = optErrorT;
+
+		transNodeCount ++;
+
 		nodeTrans.w = nodeTransParent.w/2;
-		maxTransDis = SQRT3/2.0*nodeTrans.w;
+		maxTransDis = (DIM == 3 ? SQRT3 : SQRT2)/2.0*nodeTrans.w;
+		halfW = nodeTrans.w/2;
 
-		for(j = 0; j < 8; j++)
+		// All subcubes have the same size and are looked up at the same pyramid level
+		boxLevel = (DIM == 3 && transBoxBound) ? dt.PyramidLevel(nodeTrans.w/2) : -1;
+
+		// Per-point lower bounds are not monotonic in the centre distances, trimming selects their own inliers
+		ownLb = boxLevel >= 0 || yawRadius;
+
+		// Centres of the 8 subcubes (4 subsquares)
+		for(j = 0; j < NCHILD; j++)
 		{
-			nodeTrans.x = nodeTransParent.x + (j&1)*nodeTrans.w ;
-			nodeTrans.y = nodeTransParent.y + (j>>1&1)*nodeTrans.w ;
-			nodeTrans.z = nodeTransParent.z + (j>>2&1)*nodeTrans.w ;
+			transX[j] = nodeTransParent.x + (j&1)*nodeTrans.w + nodeTrans.w/2;
+			transY[j] = nodeTransParent.y + (j>>1&1)*nodeTrans.w + nodeTrans.w/2;
+			transZ[j] = DIM == 3 ? nodeTransParent.z + (j>>2&1)*nodeTrans.w + nodeTrans.w/2 : 0;
+			ubs[j] = 0;
+			lbs[j] = 0;
+			pruned[j] = false;
+		}
 
-			transX = nodeTrans.x + nodeTrans.w/2;
-			transY = nodeTrans.y + nodeTrans.w/2;
-			transZ = nodeTrans.z + nodeTrans.w/2;
-			
-			// For each data point, calculate the distance to it's closest point in the model cloud
-			for(i = 0; i < Nd; i++)
+		if(useShell)
+		{
+			for(j = 0; j < NCHILD; j++)
 			{
-				// Find distance between transformed point and closest point in model set ||R_r0 * x + t0 - y||
-				// pDataTemp is the data points rotated by R0
-				minDis[i] = dt.Distance(pDataTemp[i].x + transX, pDataTemp[i].y + transY, pDataTemp[i].z + transZ);
-
-				// Subtract the rotation uncertainty radius if calculating the rotation lower bound
-				// maxRotDisL == NULL when calculating the rotation upper bound
-				if(maxRotDisL)
-					minDis[i] -= maxRotDisL[i];
+				nodeTrans.x = nodeTransParent.x + (j&1)*nodeTrans.w ;
+				nodeTrans.y = nodeTransParent.y + (j>>1&1)*nodeTrans.w ;
+				nodeTrans.z = nodeTransParent.z + (j>>2&1)*nodeTrans.w ;
+				shellLbs[j] = ShellLB(nodeTrans);
+				if(shellLbs[j] >= optErrorT)
+				{
+					pruned[j] = true;
+					transShellPruned ++;
+				}
+			}
+		}
 
-				if(minDis[i] < 0)
+		// Coarse pruning with one DT lookup per data cluster, while the cubes are large
+		// compared to the clusters (the subset search bounds the subset error, not the full one)
+		c = (subsetOnly || DIM < 3) ? -1 : ClusterLevel(maxTransDis + (maxRotDisL ? maxRotDisL[maxNormIdx] : 0));
+		if(c >= 0)
+		{
+			ClusterLB(c, maxRotDisL, maxTransDis, transX, transY, transZ, lbs);
+			for(j = 0; j < NCHILD; j++)
+			{
+				if(lbs[j] >= optErrorT)
 				{
-					minDis[i] = 0;
+					pruned[j] = true;
+					transClusterPruned ++;
 				}
+				lbs[j] = 0;
 			}
+		}
 
-			if(doTrim)
+		nAlive = 0;
+		for(j = 0; j < NCHILD; j++)
+		{
+			if(!pruned[j])
+				alive[nAlive++] = j;
+		}
+
+		// Evaluate the remaining subcubes in one pass over the data, so each rotated point is read once
+		// and its DT lookups are independent of each other
+		for(i = 0; i < nPts; i++)
+		{
+			// Prune with the subset lower bounds before going on with the rest of the points
+			if(i == nFirst)
 			{
-				// Sort by distance
-				//qsort(minDis, Nd, sizeof(float), cmp);
-				//myqsort(minDis, Nd, inlierNum);
-				intro_select(minDis,0,Nd-1,inlierNum-1);
+				for(k = 0, nAlive = 0; k < NCHILD; k++)
+				{
+					if(pruned[k])
+						continue;
+					if(lbs[k] >= optErrorT)
+					{
+						pruned[k] = true;
+						transSubsetPruned ++;
+					}
+					else
+						alive[nAlive++] = k;
+				}
 			}
 
-			// For each data point, find the incremental upper and lower bounds
-			ub = 0;
-			for(i = 0; i < inlierNum; i++)
+			// pDataTemp is the data points rotated by R0
+			POINT3D& p = pDataTemp[i];
+
+			// Subtract the rotation uncertainty radius if calculating the rotation lower bound
+			// maxRotDisL == NULL when calculating the rotation upper bound
+			rotDis = maxRotDisL ? maxRotDisL[i] : 0;
+			transDis = maxTransDis;
+			if(yawRadius)
 			{
-				ub += minDis[i]*minDis[i];
+				transDis = rotDis + SQRT2*halfW;
+				transDis = sqrt(transDis*transDis + halfW*halfW) - rotDis;
 			}
 
-			lb = 0;
-			for(i = 0; i < inlierNum; i++)
+			for(k = 0; k < nAlive; k++)
 			{
+				j = alive[k];
+
+				// Find distance between transformed point and closest point in model set ||R_r0 * x + t0 - y||
+				dis = DTDistance<DIM>(p.x + transX[j], p.y + transY[j], p.z + transZ[j]) - rotDis;
+				if(dis < 0)
+					dis = 0;
+
 				// Subtract the translation uncertainty radius
-				dis = minDis[i] - maxTransDis;
-				if(dis > 0)
-					lb += dis*dis;
+				lbDis = dis - transDis;
+				if(boxLevel >= 0)
+				{
+					// The minimum over the subcube itself is often tighter than over its circumscribed sphere
+					boxDis = dt.MinDistance(p.x + transX[j], p.y + transY[j], p.z + transZ[j], nodeTrans.w/2, boxLevel) - rotDis;
+					if(boxDis > lbDis)
+						lbDis = boxDis;
+				}
+
+				if(doTrim)
+				{
+					minDis8[j*Nd+i] = dis;
+					if(ownLb)
+						lbDis8[j*Nd+i] = lbDis > 0 ? lbDis : 0;
+				}
+				else
+				{
+					// Incremental upper and lower bounds
+					ubs[j] += dis*dis;
+					if(lbDis > 0)
+						lbs[j] += lbDis*lbDis;
+				}
+			}
+		}
+
+		if(doTrim)
+		{
+			for(k = 0; k < nAlive; k++)
+			{
+				j = alive[k];
+				dis8 = minDis8 + j*Nd;
+				intro_select(dis8,0,Nd-1,inlierNum-1);
+				for(i = 0; i < inlierNum; i++)
+				{
+					ubs[j] += dis8[i]*dis8[i];
+				}
+
+				if(ownLb)
+				{
+					dis8 = lbDis8 + j*Nd;
+					intro_select(dis8,0,Nd-1,inlierNum-1);
+				}
+				for(i = 0; i < inlierNum; i++)
+				{
+					dis = ownLb ? dis8[i] : dis8[i] - maxTransDis;
+					if(dis > 0)
+						lbs[j] += dis*dis;
+				}
 			}
-			
+		}
+
+		for(j = 0; j < NCHILD; j++)
+		{
+			// Already pruned by its cluster or subset lower bound
+			if(pruned[j])
+				continue;
+
+			nodeTrans.x = nodeTransParent.x + (j&1)*nodeTrans.w ;
+			nodeTrans.y = nodeTransParent.y + (j>>1&1)*nodeTrans.w ;
+			nodeTrans.z = DIM == 3 ? nodeTransParent.z + (j>>2&1)*nodeTrans.w : -nodeTrans.w/2;
+
+			ub = ubs[j];
+			lb = lbs[j];
+			if(useShell && shellLbs[j] > lb)
+				lb = shellLbs[j];
+			if(useShell && shellLbs[j] > ub)
+				ub = shellLbs[j];
 
 			// If upper bound is better than best, update optErrorT and optTransOut (optimal translation node)
 			if(ub < optErrorT)
@@ -298,87 +1806,427 @@ float GoICP::InnerBnB(float* maxRotDisL, TRANSNODE* nodeTransOut)
 				continue;
 			}
 
+			if(transSearchMode == SEARCH_BEST_UB && optErrorT-lb < SSEThresh)
+			{
+				transSearchStats.epsPruned ++;
+				continue;
+			}
+
 			nodeTrans.ub = ub;
 			nodeTrans.lb = lb;
-			queueTrans.push(nodeTrans);
+			if(diving && (!haveDive || diveOrder(nodeTransDive, nodeTrans)))
+			{
+				if(haveDive)
+					queueTrans.push(nodeTransDive);
+				nodeTransDive = nodeTrans;
+				haveDive = true;
+			}
+			else
+				queueTrans.push(nodeTrans);
 		}
+
+		if(diving && optErrorT < optErrorTParent)
+			transSearchStats.diveImproved ++;
+		if((long long)queueTrans.size() > transSearchStats.maxQueue)
+			transSearchStats.maxQueue = queueTrans.size();
 	}
 
 	return optErrorT;
 }
 
-float GoICP::OuterBnB()
+// Rotation matrix of the centre of a rotation node (angle-axis parameterization)
+void GoICP::NodeRotation(const ROTNODE& nodeRot, Matrix& R)
 {
 	int i, j;
-	ROTNODE nodeRot, nodeRotParent;
-	TRANSNODE nodeTrans;
-	float v1, v2, v3, t, ct, ct2,st, st2;
+	float v1, v2, v3, t, ct, ct2, st;
 	float tmp121, tmp122, tmp131, tmp132, tmp231, tmp232;
-	float R11, R12, R13, R21, R22, R23, R31, R32, R33;
-	float lb, ub, error, dis;
-	clock_t clockBeginICP;
-	priority_queue<ROTNODE> queueRot;
+	float v[3], q[4], qw, qx, qy, qz, n;
 
-	// Calculate Initial Error
-	optError = 0;
+	v1 = nodeRot.a + nodeRot.w/2;
+	v2 = nodeRot.b + nodeRot.w/2;
+	v3 = nodeRot.c + nodeRot.w/2;
+
+	// Yaw interval: rotation about the z axis by the centre angle
+	if(rotDomain == ROTDOMAIN_YAW)
+	{
+		R = Matrix::eye(3);
+		R.val[0][0] = cos(v1); R.val[0][1] = -sin(v1);
+		R.val[1][0] = sin(v1); R.val[1][1] = cos(v1);
+		return;
+	}
+
+	// Quaternion face cell: the centre lies in the hyperplane q_f = 1
+	if(rotDomain == ROTDOMAIN_QUAT)
+	{
+		v[0] = v1; v[1] = v2; v[2] = v3;
+		for(i = 0, j = 0; i < 4; i++)
+			q[i] = (i == nodeRot.f) ? 1 : v[j++];
+		n = sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+		qw = q[0]/n; qx = q[1]/n; qy = q[2]/n; qz = q[3]/n;
+
+		R.val[0][0] = 1 - 2*(qy*qy + qz*qz); R.val[0][1] = 2*(qx*qy - qz*qw);     R.val[0][2] = 2*(qx*qz + qy*qw);
+		R.val[1][0] = 2*(qx*qy + qz*qw);     R.val[1][1] = 1 - 2*(qx*qx + qz*qz); R.val[1][2] = 2*(qy*qz - qx*qw);
+		R.val[2][0] = 2*(qx*qz - qy*qw);     R.val[2][1] = 2*(qy*qz + qx*qw);     R.val[2][2] = 1 - 2*(qx*qx + qy*qy);
+		return;
+	}
+
+	// Convert angle-axis rotation into a rotation matrix
+	t = sqrt(v1*v1 + v2*v2 + v3*v3);
+	if(t > 0)
+	{
+		v1 /= t;
+		v2 /= t;
+		v3 /= t;
+
+		ct = cos(t);
+		ct2 = 1 - ct;
+		st = sin(t);
+
+		tmp121 = v1*v2*ct2; tmp122 = v3*st;
+		tmp131 = v1*v3*ct2; tmp132 = v2*st;
+		tmp231 = v2*v3*ct2; tmp232 = v1*st;
+
+		R.val[0][0] = ct + v1*v1*ct2;		R.val[0][1] = tmp121 - tmp122;		R.val[0][2] = tmp131 + tmp132;
+		R.val[1][0] = tmp121 + tmp122;		R.val[1][1] = ct + v2*v2*ct2;		R.val[1][2] = tmp231 - tmp232;
+		R.val[2][0] = tmp131 - tmp132;		R.val[2][1] = tmp231 + tmp232;		R.val[2][2] = ct + v3*v3*ct2;
+	}
+	// If t == 0, the rotation angle is 0 and no rotation is required
+	else
+	{
+		R = Matrix::eye(3);
+	}
+}
+
+// Rotate data points by R into pDataTemp
+void GoICP::RotateData(const Matrix& R)
+{
+	int k;
+
+	// Cluster centroids are rotated lazily, level by level
+	for(k = 0; k < 3; k++)
+	{
+		dataRot[k][0] = R.val[k][0];
+		dataRot[k][1] = R.val[k][1];
+		dataRot[k][2] = R.val[k][2];
+	}
+	for(k = 0; k < (int)clusterRotated.size(); k++)
+		clusterRotated[k] = false;
+
+	if(rotDomain == ROTDOMAIN_YAW)
+		RotateDataKernel<ROTDOMAIN_YAW>(R);
+	else
+		RotateDataKernel<ROTDOMAIN_ANGLEAXIS>(R);
+}
+
+// Rotate the data points, specialized at compile time for rotations about the z axis
+template <int ROTDOMAIN>
+void GoICP::RotateDataKernel(const Matrix& R)
+{
+	int i;
+	float R11 = R.val[0][0], R12 = R.val[0][1], R13 = R.val[0][2];
+	float R21 = R.val[1][0], R22 = R.val[1][1], R23 = R.val[1][2];
+	float R31 = R.val[2][0], R32 = R.val[2][1], R33 = R.val[2][2];
 
 	for(i = 0; i < Nd; i++)
 	{
-		minDis[i] = dt.Distance(pData[i].x, pData[i].y, pData[i].z);
+		POINT3D& p = pData[dataOrder[i]];
+		if(ROTDOMAIN == ROTDOMAIN_YAW)
+		{
+			pDataTemp[i].x = R11*p.x + R12*p.y;
+			pDataTemp[i].y = R21*p.x + R22*p.y;
+			pDataTemp[i].z = p.z;
+		}
+		else
+		{
+			pDataTemp[i].x = R11*p.x + R12*p.y + R13*p.z;
+			pDataTemp[i].y = R21*p.x + R22*p.y + R23*p.z;
+			pDataTemp[i].z = R31*p.x + R32*p.y + R33*p.z;
+		}
 	}
-	if(doTrim)
+}
+
+// Upper bound of a rotation node whose rotation R has already been applied to pDataTemp
+// Calculates the rotation upper bound by finding the translation upper bound for a given rotation,
+// assuming that the rotation is known (zero rotation uncertainty radius)
+// If the upper bound is the best so far, run ICP and prune the queue
+float GoICP::RotNodeUB(ROTNODE& nodeRot, const Matrix& R, ROTQUEUE& queueRot)
+{
+	float ub;
+	TRANSNODE nodeTrans;
+	POINT3D transSeeds[2];
+	double timeBeginBound;
+
+	// The inner search is warm-started from the node's current translation and the so-far-best one
+	transSeeds[0].x = nodeRot.tx;
+	transSeeds[0].y = nodeRot.ty;
+	transSeeds[0].z = nodeRot.tz;
+	transSeeds[1].x = optT.val[0][0];
+	transSeeds[1].y = optT.val[1][0];
+	transSeeds[1].z = optT.val[2][0];
+	nodeTrans.x = transSeeds[0].x;
+	nodeTrans.y = transSeeds[0].y;
+	nodeTrans.z = transSeeds[0].z;
+	nodeTrans.w = 0;
+
+	timeBeginBound = WallTime();
+	if(registrationMode == REG_ROTATION_ONLY)
+		ub = TransError(NULL, transSeeds[0], Nd); // the translation is fixed
+	else
+		ub = InnerBnB(NULL /*Rotation Uncertainty Radius*/, &nodeTrans, transSeeds, 2);
+	rotUBCount ++;
+	rotUBTime += WallTime() - timeBeginBound;
+
+	nodeRot.ub = ub;
+	nodeRot.tx = nodeTrans.x + nodeTrans.w/2;
+	nodeRot.ty = nodeTrans.y + nodeTrans.w/2;
+	nodeRot.tz = nodeTrans.z + nodeTrans.w/2;
+
+	if(ub < optError)
 	{
-		// Sort by distance
-		//qsort(minDis, Nd, sizeof(float), cmp);
-		//myqsort(minDis, Nd, inlierNum);
-		intro_select(minDis,0,Nd-1,inlierNum-1);
+		// Update optimal error and rotation/translation nodes
+		optError = ub;
+		optNodeRot = nodeRot;
+		optNodeTrans = nodeTrans;
+
+		optR = R;
+		optT.val[0][0] = nodeRot.tx;
+		optT.val[1][0] = nodeRot.ty;
+		optT.val[2][0] = nodeRot.tz;
+
+		cout << "Error*: " << optError << endl;
+
+		RefineIncumbent(false);
+		PruneRotQueue(queueRot);
 	}
-	for(i = 0; i < inlierNum; i++)
+
+	return ub;
+}
+
+// Run ICP from a new incumbent, unless the invocation policy finds it too close to the start
+// of the last refinement (force refines it anyway). In the background the search goes on
+// with this incumbent meanwhile.
+void GoICP::RefineIncumbent(bool force)
+{
+	float error;
+	double timeBeginICP;
+
+	if(!force && icpMinImprovement > 0 && optError > (1 - icpMinImprovement)*icpLastStart)
+	{
+		icpSkipped ++;
+		icpDeferred = true;
+		return;
+	}
+	icpRefined ++;
+	icpLastStart = optError;
+	icpDeferred = false;
+
+	if(asyncRunning)
 	{
-		optError += minDis[i]*minDis[i];
+		AsyncICPPost(optR, optT, optError);
+		return;
 	}
+
+	timeBeginICP = WallTime();
+	Matrix R_icp = optR;
+	Matrix t_icp = optT;
+	error = ICP(R_icp, t_icp);
+	//Our ICP implementation uses kdtree for closest distance computation which is slightly different from DT approximation, 
+	//thus it's possible that ICP failed to decrease the DT error. This is no big deal as the difference should be very small.
+	if(error < optError)
+	{
+		optError = error;
+		optR = R_icp;
+		optT = t_icp;
+
+		cout << "Error*: " << error << "(ICP " << (WallTime() - timeBeginICP) << "s)" << endl;
+	}
+}
+
+// Discard all rotation nodes with high lower bounds in the queue
+// (they are only sorted by lower bound in best-bound order)
+void GoICP::PruneRotQueue(ROTQUEUE& queueRot)
+{
+	NODEORDER<ROTNODE> rotOrder(rotSearchMode);
+	ROTQUEUE queueRotNew(rotOrder);
+	while(!queueRot.empty())
+	{
+		ROTNODE node = queueRot.top();
+		queueRot.pop();
+		if(node.lb < optError)
+			queueRotNew.push(node);
+		else if(rotSearchMode != SEARCH_BEST_UB)
+			break;
+	}
+	queueRot = queueRotNew;
+}
+
+void GoICP::PrintSearchStats(const char* name, int mode, const SEARCHSTATS& stats)
+{
+	const char* modeNames[] = {"best-bound", "best-bound with dives", "best upper bound"};
+
+	cout << "Search " << name << ": " << modeNames[mode] << ", peak queue " << stats.maxQueue;
+	if(mode == SEARCH_DIVES)
+		cout << ", " << stats.dives << " dives (" << stats.diveNodes << " nodes, " << stats.diveImproved << " improvements)";
+	if(mode == SEARCH_BEST_UB)
+		cout << ", " << stats.boundPops << " best-bound pops";
+	if(stats.epsPruned > 0)
+		cout << ", " << stats.epsPruned << " nodes discarded within epsilon";
+	cout << endl;
+}
+
+void GoICP::PrintLocalStats()
+{
+	cout << "Local refinement: " << (localOptimizer == LOCAL_DT_LM ? "DT Levenberg-Marquardt" : "ICP") << ", "
+		<< localCount << " runs (" << localTime << "s)";
+	if(localOptimizer == LOCAL_DT_LM)
+		cout << ", " << localIterations << " iterations";
+	cout << endl;
+	if(icpMinImprovement > 0 || icpTimeBudget > 0 || icpAdaptiveIter)
+		cout << "ICP policy: " << icpRefined << " upper bounds refined, " << icpSkipped << " skipped, "
+			<< icpTruncated << " runs stopped by the iteration cap or time budget, cap " << icpIterCap << endl;
+	if(icpCacheSize > 0)
+		cout << "ICP cache: " << icpCacheHits << " of " << icpCacheLookups << " runs reused, "
+			<< icpCache.size() << " minima" << endl;
+	if(asyncRunning)
+		cout << "Asynchronous ICP: " << asyncPosted << " requests, " << asyncMerged << " merged, "
+			<< asyncAborted << " stopped early, " << asyncAdopted << " results adopted, "
+			<< asyncWaitTime << "s waiting at the end" << endl;
+}
+
+float GoICP::OuterBnB()
+{
+	int j, numSeeds;
+	long long pops;
+	bool diving, haveDive, boundPop;
+	ROTNODE nodeRot, nodeRotParent, nodeRotDive;
+	TRANSNODE nodeTrans;
+	POINT3D transSeed, transSeeds[2];
+	float v1, v2, v3;
+	float lb, error, optErrorParent;
+	float * rotDis;
+	double timeBeginICP, timeBeginBound;
+	NODEORDER<ROTNODE> rotOrder(rotSearchMode), diveOrder(SEARCH_BEST_UB);
+	ROTQUEUE queueRot(rotOrder);
+	Matrix R(3,3);
+
+	// Calculate Initial Error
+	optError = PoseError(optR, optT, minDis);
 	cout << "Error*: " << optError << " (Init)" << endl;
 
 	Matrix R_icp = optR;
 	Matrix t_icp = optT;
 
 	// Run ICP from initial state
-	clockBeginICP = clock();
+	timeBeginICP = WallTime();
 	error = ICP(R_icp, t_icp);
 	if(error < optError)
 	{
 		optError = error;
 		optR = R_icp;
 		optT = t_icp;
-		cout << "Error*: " << error << " (ICP " << (double)(clock()-clockBeginICP)/CLOCKS_PER_SEC << "s)" << endl;
+		cout << "Error*: " << error << " (ICP " << (WallTime() - timeBeginICP) << "s)" << endl;
 		cout << "ICP-ONLY Rotation Matrix:" << endl;
 		cout << R_icp << endl;
 		cout << "ICP-ONLY Translation Vector:" << endl;
 		cout << t_icp << endl;
 	}
 
+	if(multiStartCount > 0 && registrationMode == REG_FULL)
+		MultiStartICP();
+
 	// Push top-level rotation node into priority queue
-	queueRot.push(initNodeRot);
+	initNodeRot.tx = initNodeTrans.x + initNodeTrans.w/2;
+	initNodeRot.ty = initNodeTrans.y + initNodeTrans.w/2;
+	initNodeRot.tz = initNodeTrans.z + initNodeTrans.w/2;
+	if(registrationMode == REG_ROTATION_ONLY)
+	{
+		initNodeRot.tx = fixedT.val[0][0];
+		initNodeRot.ty = fixedT.val[1][0];
+		initNodeRot.tz = fixedT.val[2][0];
+	}
+	initNodeRot.ub = -1;
+	if(rotDomain == ROTDOMAIN_YAW)
+	{
+		// The yaw interval is stored in a, the other rotation coordinates stay 0
+		nodeRot = initNodeRot;
+		nodeRot.a = initNodeRot.c;
+		nodeRot.b = nodeRot.c = 0;
+		queueRot.push(nodeRot);
+	}
+	else if(rotDomain == ROTDOMAIN_QUAT)
+	{
+		// One root cell [-1,1]^3 per hypercube face
+		nodeRot = initNodeRot;
+		nodeRot.a = nodeRot.b = nodeRot.c = -1;
+		nodeRot.w = 2;
+		for(nodeRot.f = 0; nodeRot.f < 4; nodeRot.f++)
+			queueRot.push(nodeRot);
+	}
+	else
+		queueRot.push(initNodeRot);
+
+	// ICP from the outer search goes to a background thread, restricted modes have no ICP to run
+	asyncRunning = asyncICP && localOptimizer == LOCAL_ICP && registrationMode != REG_ROTATION_ONLY;
+	asyncPosted = asyncMerged = asyncAborted = asyncAdopted = 0;
+	asyncWaitTime = 0;
+	icpLastStart = FLT_MAX;
+	icpDeferred = false;
+	if(asyncRunning)
+		AsyncICPStart();
 
 	// Keep exploring rotation space until convergence is achieved
 	long long count = 0;
+	diving = false;
+	haveDive = false;
+	boundPop = false;
+	pops = 0;
 	while(1)
 	{
-		if(queueRot.empty())
+		if(asyncRunning)
+			AsyncICPAdopt(queueRot);
+
+		// A dive goes on with the most promising child of the last expanded node
+		if(haveDive)
 		{
-		  cout << "Rotation Queue Empty" << endl;
-		  cout << "Error*: " << optError << ", LB: " << lb << endl;
-		  break;
+			nodeRotParent = nodeRotDive;
+			haveDive = false;
 		}
+		else
+		{
+			if(queueRot.empty())
+			{
+			  cout << "Rotation Queue Empty" << endl;
+			  cout << "Error*: " << optError << ", LB: " << lb << endl;
+			  break;
+			}
 
-		// Access rotation cube with lowest lower bound...
-		nodeRotParent = queueRot.top();
-		// ...and remove it from the queue
-		queueRot.pop();
+			// Lowest upper bound first still takes the lowest lower bound every diveInterval pops
+			boundPop = rotSearchMode == SEARCH_BEST_UB && ++pops % (diveInterval > 0 ? diveInterval : BOUND_POP_INTERVAL) == 0;
+			if(boundPop)
+			{
+				rotSearchStats.boundPops ++;
+				nodeRotParent = queueRot.topBound();
+				queueRot.popBound();
+			}
+			else
+			{
+				// Access rotation cube with lowest lower bound...
+				nodeRotParent = queueRot.top();
+				// ...and remove it from the queue
+				queueRot.pop();
+			}
+			diving = false;
+		}
 
 		// Exit if the optError is less than or equal to the lower bound plus a small epsilon
 		if((optError-nodeRotParent.lb) <= SSEThresh)
 		{
+			// Only a node popped in best-bound order has the lowest lower bound of all
+			if(diving || (rotSearchMode == SEARCH_BEST_UB && !boundPop))
+			{
+				rotSearchStats.epsPruned ++;
+				continue;
+			}
 			cout << "Error*: " << optError << ", LB: " << nodeRotParent.lb << ", epsilon: " << SSEThresh << endl;
 			break;
 		}
@@ -386,12 +2234,35 @@ float GoICP::OuterBnB()
 		if(count>0 && count%300 == 0)
 			printf("LB=%f  L=%d\n",nodeRotParent.lb,nodeRotParent.l);
 		count ++;
+
+		if(diving)
+			rotSearchStats.diveNodes ++;
+		else if(rotSearchMode == SEARCH_DIVES && count % (diveInterval > 0 ? diveInterval : DIVE_INTERVAL) == 0)
+		{
+			diving = true;
+			rotSearchStats.dives ++;
+		}
+		optErrorParent = optError;
+
+		// Deferred upper bound, evaluated only now that the node is about to be subdivided
+		if(upperBoundMode == UB_ON_POP && nodeRotParent.ub < 0)
+		{
+			NodeRotation(nodeRotParent, R);
+			RotateData(R);
+			RotNodeUB(nodeRotParent, R, queueRot);
+			if(nodeRotParent.lb >= optError)
+				continue;
+		}
+
+		rotNodeCount ++;
 		
 		// Subdivide rotation cube into octant subcubes and calculate upper and lower bounds for each
 		nodeRot.w = nodeRotParent.w/2;
 		nodeRot.l = nodeRotParent.l+1;
-		// For each subcube,
-		for(j = 0; j < 8; j++)
+		nodeRot.f = nodeRotParent.f;
+		numSeeds = 1;
+		// For each subcube (each half of a yaw interval),
+		for(j = 0; j < (rotDomain == ROTDOMAIN_YAW ? 2 : 8); j++)
 		{
 		  // Calculate the smallest rotation across each dimension
 			nodeRot.a = nodeRotParent.a + (j&1)*nodeRot.w ;
@@ -404,106 +2275,86 @@ float GoICP::OuterBnB()
 			v3 = nodeRot.c + nodeRot.w/2;
 
 			// Skip subcube if it is completely outside the rotation PI-ball
-			if(sqrt(v1*v1+v2*v2+v3*v3)-SQRT3*nodeRot.w/2 > PI)
+			if(rotDomain == ROTDOMAIN_ANGLEAXIS && sqrt(v1*v1+v2*v2+v3*v3)-SQRT3*nodeRot.w/2 > PI)
 			{
+				rotOutsideCount ++;
 				continue;
 			}
 
-			// Convert angle-axis rotation into a rotation matrix
-			t = sqrt(v1*v1 + v2*v2 + v3*v3);
-			if(t > 0)
-			{
-				v1 /= t;
-				v2 /= t;
-				v3 /= t;
-
-				ct = cos(t);
-				ct2 = 1 - ct;
-				st = sin(t);
-				st2 = 1 - st;
-
-				tmp121 = v1*v2*ct2; tmp122 = v3*st;
-				tmp131 = v1*v3*ct2; tmp132 = v2*st;
-				tmp231 = v2*v3*ct2; tmp232 = v1*st;
+			// Rotate data points by subcube rotation matrix
+			NodeRotation(nodeRot, R);
+			RotateData(R);
 
-				R11 = ct + v1*v1*ct2;		R12 = tmp121 - tmp122;		R13 = tmp131 + tmp132;
-				R21 = tmp121 + tmp122;		R22 = ct + v2*v2*ct2;		R23 = tmp231 - tmp232;
-				R31 = tmp131 - tmp132;		R32 = tmp231 + tmp232;		R33 = ct + v3*v3*ct2;
+			// The child starts from the parent's best translation until its own inner search finds a better one
+			nodeRot.tx = nodeRotParent.tx;
+			nodeRot.ty = nodeRotParent.ty;
+			nodeRot.tz = nodeRotParent.tz;
+			nodeRot.ub = -1;
 
-				// Rotate data points by subcube rotation matrix
-				for(i = 0; i < Nd; i++)
-				{
-					POINT3D& p = pData[i];
-					pDataTemp[i].x = R11*p.x + R12*p.y + R13*p.z;
-					pDataTemp[i].y = R21*p.x + R22*p.y + R23*p.z;
-					pDataTemp[i].z = R31*p.x + R32*p.y + R33*p.z;
-				}
+			// Upper Bound
+			if(upperBoundMode == UB_EAGER)
+			{
+				RotNodeUB(nodeRot, R, queueRot);
 			}
-			// If t == 0, the rotation angle is 0 and no rotation is required
+
+			// Lower Bound
+			// Run Inner Branch-and-Bound to find rotation lower bound
+			// Calculates the rotation lower bound by finding the translation upper bound for a given rotation,
+			// assuming that the rotation is uncertain (a positive rotation uncertainty radius)
+			// Pass an array of rotation uncertainties for every point in data cloud at this level
+			transSeed.x = nodeRot.tx;
+			transSeed.y = nodeRot.ty;
+			transSeed.z = nodeRot.tz;
+			transSeeds[0] = transSeed;
+			timeBeginBound = WallTime();
+			if(rotDomain == ROTDOMAIN_QUAT)
+				rotDis = RotDisAtCell(nodeRot);
 			else
+				rotDis = RotDisAtLevel(nodeRot.l);
+			lb = 0;
+			if(registrationMode == REG_ROTATION_ONLY)
 			{
-				memcpy(pDataTemp, pData, sizeof(POINT3D)*Nd);
+				// With the translation fixed, the lower bound is a single pass over the data
+				lb = TransError(rotDis, transSeed, Nd);
 			}
-
-			// Upper Bound
-			// Run Inner Branch-and-Bound to find rotation upper bound
-			// Calculates the rotation upper bound by finding the translation upper bound for a given rotation,
-			// assuming that the rotation is known (zero rotation uncertainty radius)
-			ub = InnerBnB(NULL /*Rotation Uncertainty Radius*/, &nodeTrans);
-
-			// If the upper bound is the best so far, run ICP
-			if(ub < optError)
-			{
-				// Update optimal error and rotation/translation nodes
-				optError = ub;
-				optNodeRot = nodeRot;
-				optNodeTrans = nodeTrans;
-
-				optR.val[0][0] = R11; optR.val[0][1] = R12; optR.val[0][2] = R13;
-				optR.val[1][0] = R21; optR.val[1][1] = R22; optR.val[1][2] = R23;
-				optR.val[2][0] = R31; optR.val[2][1] = R32; optR.val[2][2] = R33;
-				optT.val[0][0] = optNodeTrans.x+optNodeTrans.w/2;
-				optT.val[1][0] = optNodeTrans.y+optNodeTrans.w/2;
-				optT.val[2][0] = optNodeTrans.z+optNodeTrans.w/2;
-
-				cout << "Error*: " << optError << endl;
-
-				// Run ICP
-				clockBeginICP = clock();
-				R_icp = optR;
-				t_icp = optT;
-				error = ICP(R_icp, t_icp);
-				//Our ICP implementation uses kdtree for closest distance computation which is slightly different from DT approximation, 
-				//thus it's possible that ICP failed to decrease the DT error. This is no big deal as the difference should be very small.
-				if(error < optError)
+			else if(subsetNum > 0)
+			{
+				// Cheap pruning with the subset lower bound first
+				lb = InnerBnB(rotDis, NULL /*Translation Node*/, transSeeds, numSeeds, true);
+				if(lb >= optError)
+					rotSubsetPruned ++;
+			}
+			if(lb < optError && registrationMode != REG_ROTATION_ONLY)
+			{
+				if(nodeRot.ub < 0)
 				{
-					optError = error;
-					optR = R_icp;
-					optT = t_icp;
-					
-					cout << "Error*: " << error << "(ICP " << (double)(clock() - clockBeginICP)/CLOCKS_PER_SEC << "s)" << endl;
+					// Without an upper bound search yet, keep the translation the lower bound search settles on
+					nodeTrans.x = transSeed.x;
+					nodeTrans.y = transSeed.y;
+					nodeTrans.z = transSeed.z;
+					nodeTrans.w = 0;
+					lb = InnerBnB(rotDis, &nodeTrans, transSeeds, numSeeds);
+					nodeRot.tx = nodeTrans.x + nodeTrans.w/2;
+					nodeRot.ty = nodeTrans.y + nodeTrans.w/2;
+					nodeRot.tz = nodeTrans.z + nodeTrans.w/2;
 				}
-
-				// Discard all rotation nodes with high lower bounds in the queue
-				priority_queue<ROTNODE> queueRotNew;
-				while(!queueRot.empty())
+				else
 				{
-					ROTNODE node = queueRot.top();
-					queueRot.pop();
-					if(node.lb < optError)
-						queueRotNew.push(node);
-					else
-						break;
+					lb = InnerBnB(rotDis, NULL /*Translation Node*/, transSeeds, numSeeds);
 				}
-				queueRot = queueRotNew;
 			}
+			rotLBCount ++;
+			rotLBTime += WallTime() - timeBeginBound;
 
-			// Lower Bound
-			// Run Inner Branch-and-Bound to find rotation lower bound
-			// Calculates the rotation lower bound by finding the translation upper bound for a given rotation,
-			// assuming that the rotation is uncertain (a positive rotation uncertainty radius)
-			// Pass an array of rotation uncertainties for every point in data cloud at this level
-			lb = InnerBnB(maxRotDis[nodeRot.l], NULL /*Translation Node*/);
+			// The two yaw halves share the tilt of the data, the second one also starts from the
+			// best translation of the first
+			if(rotDomain == ROTDOMAIN_YAW && (nodeRot.tx != transSeed.x || nodeRot.ty != transSeed.y || nodeRot.tz != transSeed.z))
+			{
+				transSeeds[1].x = nodeRot.tx;
+				transSeeds[1].y = nodeRot.ty;
+				transSeeds[1].z = nodeRot.tz;
+				numSeeds = 2;
+			}
 
 			// If the best error so far is less than the lower bound, remove the rotation subcube from the queue
 			if(lb >= optError)
@@ -511,20 +2362,127 @@ float GoICP::OuterBnB()
 				continue;
 			}
 
+			// Subdividing beyond maxRotLevel cannot improve the bounds, refine locally instead
+			if(nodeRot.l >= maxRotLevel)
+			{
+				// The deferred modes never queue a leaf, bound it from above here as the eager mode
+				// does, and refine from the translation of that inner search
+				if(nodeRot.ub < 0)
+					RotNodeUB(nodeRot, R, queueRot);
+				Matrix t_leaf(3,1);
+				t_leaf.val[0][0] = nodeRot.tx;
+				t_leaf.val[1][0] = nodeRot.ty;
+				t_leaf.val[2][0] = nodeRot.tz;
+				RefineLeaf(R, t_leaf);
+				continue;
+			}
+
+			if(upperBoundMode == UB_SURVIVORS)
+			{
+				RotNodeUB(nodeRot, R, queueRot);
+				if(lb >= optError)
+					continue;
+			}
+
+			// Out of best-bound order, drop nodes within epsilon now rather than when they are popped
+			if(rotSearchMode == SEARCH_BEST_UB && optError-lb <= SSEThresh)
+			{
+				rotSearchStats.epsPruned ++;
+				continue;
+			}
+
 			// Update node and put it in queue
-			nodeRot.ub = ub;
 			nodeRot.lb = lb;
-			queueRot.push(nodeRot);
+			if(diving && (!haveDive || diveOrder(nodeRotDive, nodeRot)))
+			{
+				if(haveDive)
+					queueRot.push(nodeRotDive);
+				nodeRotDive = nodeRot;
+				haveDive = true;
+			}
+			else
+				queueRot.push(nodeRot);
 		}
+
+		if(diving && optError < optErrorParent)
+			rotSearchStats.diveImproved ++;
+		if((long long)queueRot.size() > rotSearchStats.maxQueue)
+			rotSearchStats.maxQueue = queueRot.size();
+	}
+
+	// A lower incumbent only narrows the gap the search ended with
+	if(icpDeferred)
+		RefineIncumbent(true);
+	if(asyncRunning)
+	{
+		AsyncICPFinish();
+		AsyncICPAdopt(queueRot);
 	}
 
+	cout << "Nodes expanded: " << rotNodeCount << " rotation, " << transNodeCount << " translation" << endl;
+	cout << "Rotation bounds: " << rotUBCount << " upper (" << rotUBTime << "s), "
+		<< rotLBCount << " lower (" << rotLBTime << "s)" << endl;
+	if(rotDomain == ROTDOMAIN_ANGLEAXIS)
+		cout << "Rotation subcubes outside the PI-ball: " << rotOutsideCount << endl;
+	PrintSearchStats("rotation", rotSearchMode, rotSearchStats);
+	PrintSearchStats("translation", transSearchMode, transSearchStats);
+	PrintLocalStats();
+	if(shellBoundFactor > 0)
+		cout << "Pruned by shell lower bounds: " << transShellPruned << " translation cubes (" << shellCache.size() << " cached)" << endl;
+	if(clusters.size() > 0)
+		cout << "Pruned by cluster lower bounds: " << transClusterPruned << " translation subcubes" << endl;
+	if(subsetNum > 0)
+		cout << "Pruned by subset lower bounds: " << rotSubsetPruned << " rotation, " << transSubsetPruned << " translation subcubes" << endl;
+
+	return optError;
+}
+
+// Translation-only registration: a single translation search with the rotation fixed
+float GoICP::TransOnlyBnB()
+{
+	float error;
+	double timeBeginBound;
+	TRANSNODE nodeTrans;
+	POINT3D transSeed;
+
+	optError = PoseError(optR, optT, minDis);
+	cout << "Error*: " << optError << " (Init)" << endl;
+
+	RotateData(optR);
+	transSeed.x = optT.val[0][0];
+	transSeed.y = optT.val[1][0];
+	transSeed.z = optT.val[2][0];
+	nodeTrans.x = transSeed.x;
+	nodeTrans.y = transSeed.y;
+	nodeTrans.z = transSeed.z;
+	nodeTrans.w = 0;
+
+	timeBeginBound = WallTime();
+	error = InnerBnB(NULL /*Rotation Uncertainty Radius*/, &nodeTrans, &transSeed, 1);
+	if(error < optError)
+	{
+		optError = error;
+		optNodeTrans = nodeTrans;
+		optT.val[0][0] = nodeTrans.x + nodeTrans.w/2;
+		optT.val[1][0] = nodeTrans.y + nodeTrans.w/2;
+		optT.val[2][0] = nodeTrans.z + nodeTrans.w/2;
+	}
+	cout << "Error*: " << optError << ", epsilon: " << SSEThresh << endl;
+
+	cout << "Nodes expanded: 0 rotation, " << transNodeCount << " translation ("
+		<< (WallTime() - timeBeginBound) << "s)" << endl;
+	PrintSearchStats("translation", transSearchMode, transSearchStats);
+
 	return optError;
 }
 
 float GoICP::Register()
 {
 	Initialize();
-	OuterBnB();
+	if(registrationMode == REG_TRANSLATION_ONLY)
+		TransOnlyBnB();
+	else
+		OuterBnB();
 	Clear();
 
 	return optError;
@@ -26,6 +26,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define JLY_GOICP_H
 
 #include <queue>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 using namespace std;
 
 #include "jly_icp3d.hpp"
@@ -33,6 +40,7 @@ using namespace std;
 
 #define PI 3.1415926536
 #define SQRT3 1.732050808
+#define SQRT2 1.414213562
 
 typedef struct _POINT3D
 {
@@ -44,6 +52,8 @@ typedef struct _ROTNODE
 	float a, b, c, w;
 	float ub, lb;
 	int l;
+	float tx, ty, tz; // best translation found for the node, seeds the inner search of its children
+	int f; // face of the quaternion hypercube (ROTDOMAIN_QUAT)
 	friend bool operator < (const struct _ROTNODE & n1, const struct _ROTNODE & n2)
 	{
 		if(n1.lb != n2.lb)
@@ -69,13 +79,205 @@ typedef struct _TRANSNODE
 	}
 }TRANSNODE;
 
+// A converged ICP run, and the displacement radius of the starts taken to lie in its basin
+typedef struct _ICPCACHEENTRY
+{
+	Matrix R, t;
+	float error;
+	float radius;
+	long long key;
+}ICPCACHEENTRY;
+
+// A cluster of data points, bounding all its members with one DT lookup
+typedef struct _DATACLUSTER
+{
+	POINT3D c; // centroid
+	float r; // largest distance of a member to the centroid
+	int n; // number of members
+	int far; // member with the largest norm
+}DATACLUSTER;
+
 /********************************************************/
 
 
 
 /********************************************************/
 
-#define MAXROTLEVEL 20
+// Hard cap on the rotation subdivision depth, only reached if the DT is
+// extremely fine compared to the data extent
+#define MAXROTLEVEL 32
+
+// Parameterization of the rotation domain
+#define ROTDOMAIN_ANGLEAXIS 0 // octree over the angle-axis cube [-PI,PI]^3, clipped to the PI-ball
+#define ROTDOMAIN_QUAT 1 // octrees over the 4 faces q_f = max|q_i| of the unit quaternion hypercube
+#define ROTDOMAIN_YAW 2 // binary tree over the yaw interval [rotMinZ, rotMinZ+rotWidth], for 4-DOF
+                        // registration of data whose roll and pitch are already aligned
+
+// Registration modes
+#define REG_FULL 0 // rotation and translation
+#define REG_ROTATION_ONLY 1 // rotation only, translation fixed to fixedT
+#define REG_TRANSLATION_ONLY 2 // translation only, rotation fixed to fixedR
+#define REG_PLANAR 3 // SE(2): rotation about the z axis (ROTDOMAIN_YAW) and translation in the xy
+                     // plane, on the 2D DT of the xy projections (z coordinates are ignored)
+
+// How ICP finds the closest model points
+#define ICP_NN_KDTREE 0 // exact, kdtree search
+#define ICP_NN_GRID 1 // approximate, closest-point transform kept with the DT (O(1) lookups)
+#define ICP_NN_GRID_EXACT 2 // grid until convergence, then exact kdtree iterations
+
+// Local optimizer run from the initial pose and from every improved upper bound
+#define LOCAL_ICP 0 // point-to-point ICP on the model kdtree (ICP3D), scored against the DT afterwards
+#define LOCAL_DT_LM 1 // Levenberg-Marquardt on the trimmed DT error itself, with finite-difference
+                      // DT gradients; keeps the fixed part of the pose in the restricted modes
+#define DTLM_MAXITER 100
+
+// A cached ICP minimum is reused for starts within this fraction of the farthest start
+// (in data point displacement) that converged to it
+#define ICP_BASIN_FACTOR 0.5
+
+// Adaptive ICP iteration caps: a run may use this factor times the iterations the last
+// converged run needed (at least ICP_ITER_CAP_MIN), a run stopped by its cap doubles it
+#define ICP_ITER_CAP_FACTOR 2
+#define ICP_ITER_CAP_MIN 10
+
+// When the upper bound of a rotation node is evaluated
+#define UB_EAGER 0 // for every child, before its lower bound
+#define UB_SURVIVORS 1 // only for children not pruned by their lower bound
+#define UB_ON_POP 2 // only when the node is popped from the queue to be subdivided
+
+// Data clusters are used for a translation subcube while their radius is below
+// this fraction of its total (translation + rotation) uncertainty radius
+#define CLUSTER_RADIUS_RATIO 0.5
+#define MAXCLUSTERLEVEL 10
+
+// Node selection strategies of the rotation and translation searches
+#define SEARCH_BEST_BOUND 0 // lowest lower bound first
+#define SEARCH_DIVES 1 // lowest lower bound first, with periodic depth-first dives
+#define SEARCH_BEST_UB 2 // lowest upper bound first
+#define DIVE_INTERVAL 32 // default number of expansions between two dives
+#define BOUND_POP_INTERVAL 2 // default number of pops between two best-bound pops (SEARCH_BEST_UB)
+
+// Queue order of a search strategy. Rotation nodes whose upper bound is
+// not evaluated yet (ub < 0) come after the evaluated ones.
+template <class NODE>
+struct NODEORDER
+{
+	int mode;
+	NODEORDER(int mode_ = SEARCH_BEST_BOUND) : mode(mode_) {}
+	bool operator () (const NODE & n1, const NODE & n2) const
+	{
+		if(mode == SEARCH_BEST_UB && n1.ub != n2.ub)
+		{
+			if(n1.ub < 0 || n2.ub < 0)
+				return n1.ub < 0;
+			return n1.ub > n2.ub;
+		}
+		return n1 < n2;
+	}
+};
+
+// Priority queue of the nodes of a search, in the order of its strategy. In lowest upper bound
+// first order, the nodes are also kept in best-bound order, so that the search can expand the
+// node with the lowest lower bound every few expansions (popBound) and end on the epsilon test.
+// A node taken from one heap is only marked, and skipped once it reaches the top of the other.
+template <class NODE>
+class NODEQUEUE
+{
+public:
+	NODEQUEUE(const NODEORDER<NODE>& order) : heapOrder(order), boundOrder(SEARCH_BEST_BOUND), alive(0) {}
+
+	bool empty() const { return alive == 0; }
+	size_t size() const { return alive; }
+
+	void push(const NODE& node)
+	{
+		ENTRY e;
+		e.node = node;
+		e.id = 0;
+		if(heapOrder.order.mode == SEARCH_BEST_UB)
+		{
+			e.id = (int)taken.size();
+			taken.push_back(0);
+			boundHeap.push_back(e);
+			push_heap(boundHeap.begin(), boundHeap.end(), boundOrder);
+		}
+		heap.push_back(e);
+		push_heap(heap.begin(), heap.end(), heapOrder);
+		alive ++;
+	}
+
+	const NODE& top() { Skip(heap, heapOrder); return heap.front().node; }
+	void pop() { Skip(heap, heapOrder); Take(heap, heapOrder); }
+
+	// The node with the lowest lower bound, whatever the order of the queue
+	const NODE& topBound()
+	{
+		if(heapOrder.order.mode != SEARCH_BEST_UB)
+			return top();
+		Skip(boundHeap, boundOrder);
+		return boundHeap.front().node;
+	}
+	void popBound()
+	{
+		if(heapOrder.order.mode != SEARCH_BEST_UB)
+		{
+			pop();
+			return;
+		}
+		Skip(boundHeap, boundOrder);
+		Take(boundHeap, boundOrder);
+	}
+
+private:
+	struct ENTRY
+	{
+		NODE node;
+		int id; // index in taken (SEARCH_BEST_UB)
+	};
+	struct ENTRYORDER
+	{
+		NODEORDER<NODE> order;
+		ENTRYORDER(const NODEORDER<NODE>& order_) : order(order_) {}
+		bool operator () (const ENTRY & e1, const ENTRY & e2) const { return order(e1.node, e2.node); }
+	};
+
+	// Drop the nodes already taken from the other heap off the top of this one
+	void Skip(vector<ENTRY>& h, const ENTRYORDER& o)
+	{
+		while(heapOrder.order.mode == SEARCH_BEST_UB && taken[h.front().id])
+		{
+			pop_heap(h.begin(), h.end(), o);
+			h.pop_back();
+		}
+	}
+	void Take(vector<ENTRY>& h, const ENTRYORDER& o)
+	{
+		if(heapOrder.order.mode == SEARCH_BEST_UB)
+			taken[h.front().id] = 1;
+		pop_heap(h.begin(), h.end(), o);
+		h.pop_back();
+		alive --;
+	}
+
+	ENTRYORDER heapOrder, boundOrder;
+	vector<ENTRY> heap, boundHeap;
+	vector<char> taken;
+	size_t alive;
+};
+
+typedef NODEQUEUE<ROTNODE> ROTQUEUE;
+typedef NODEQUEUE<TRANSNODE> TRANSQUEUE;
+
+// Per-strategy statistics of a search
+typedef struct _SEARCHSTATS
+{
+	long long dives; // number of depth-first dives
+	long long diveNodes; // nodes expanded during dives
+	long long diveImproved; // incumbent improvements found during dives
+	long long epsPruned; // popped nodes discarded within epsilon of the incumbent
+	long long boundPops; // lowest lower bound expansions of the lowest upper bound order
+	long long maxQueue; // peak queue size
+}SEARCHSTATS;
 
 class GoICP
 {
@@ -87,6 +289,7 @@ public:
 	TRANSNODE initNodeTrans;
 
 	DT3D dt;
+	DT2D dt2; // REG_PLANAR only, built instead of dt
 
 	ROTNODE optNodeRot;
 	TRANSNODE optNodeTrans;
@@ -109,22 +312,188 @@ public:
 	int inlierNum;
 	bool doTrim;
 
+	// Registration mode (REG_*) and the fixed part of the pose. ICP refinement, which moves
+	// the whole pose, is only used in REG_FULL.
+	int registrationMode;
+	Matrix fixedR;
+	Matrix fixedT;
+
+	// Deepest useful rotation level, derived from the DT resolution
+	int maxRotLevel;
+
+	int upperBoundMode;
+
+	// Node selection strategies (SEARCH_*), and expansions between two dives (0 for DIVE_INTERVAL)
+	// or pops between two best-bound pops of SEARCH_BEST_UB (0 for BOUND_POP_INTERVAL)
+	int rotSearchMode, transSearchMode;
+	int diveInterval;
+
+	// Multi-start ICP before the outer search: number of SO(3) grid starts (besides the 4
+	// principal axes alignments, 0 to disable) and time budget in seconds (0 for none)
+	int multiStartCount;
+	float multiStartTime;
+
+	// Number of stratified data points used for subset-first lower bounds (0 to disable, untrimmed only)
+	int lbSubsetSize;
+
+	// Depth of the data point octree used for coarse cluster lower bounds (0 to disable)
+	int dataClusterLevels;
+
+	// Bound translation subcubes by the DT minimum over the box (needs the DT min-pyramid)
+	bool transBoxBound;
+
+	// Use the rotation-invariant shell bound while the rotation uncertainty radius is at least
+	// this factor times the point norm (2 when the rotation angle is clamped to PI, 0 to disable)
+	float shellBoundFactor;
+
+	// ICP correspondences (ICP_NN_*)
+	int icpClosestPoint;
+
+	// Minimize point-to-plane instead of point-to-point distances in the ICP of the full mode,
+	// against model normals estimated once in Initialize
+	bool icpPointToPlane;
+
+	// Warm-start the ICP correspondence search from the previous iteration's closest model
+	// points along a model kNN graph (exact, 36 more bytes per model point)
+	bool icpWarmStart;
+
+	// ICP stages on random data subsets before the full data (ICP_COARSE_*, 0 for none)
+	int icpCoarseStages;
+
+	// Local optimizer (LOCAL_*). The multi-start always uses ICP3D, whose runs can share the kdtree.
+	int localOptimizer;
+
+	// Run the ICP of improved upper bounds and leaf nodes on a background thread while the outer
+	// search goes on with the current incumbent (LOCAL_ICP, full and planar modes)
+	bool asyncICP;
+
+	// Number of converged ICP results kept to skip the runs started in their basins (0 to disable)
+	int icpCacheSize;
+
+	// ICP invocation policy of the outer search: refine a new upper bound only if it is at least
+	// this fraction below the start of the last refinement (0 for all, the last skipped one is
+	// refined at the end), stop each ICP run after icpTimeBudget seconds (0 for no limit), and
+	// cap the iterations of each run by those of the last ones (ICP_ITER_CAP_*)
+	float icpMinImprovement;
+	float icpTimeBudget;
+	bool icpAdaptiveIter;
+
+	// Rotation domain parameterization (ROTDOMAIN_*). The quaternion faces tile all of SO(3)
+	// once, initNodeRot only applies to the angle-axis cube (and its c, w to the yaw interval).
+	int rotDomain;
+
+	// Search statistics
+	long long rotNodeCount;
+	long long transNodeCount;
+	long long rotUBCount, rotLBCount;
+	double rotUBTime, rotLBTime;
+	long long rotSubsetPruned, transSubsetPruned;
+	long long transClusterPruned;
+	long long transShellPruned;
+	long long rotOutsideCount;
+	SEARCHSTATS rotSearchStats, transSearchStats;
+	long long localCount, localIterations;
+	double localTime;
+	long long icpCacheLookups, icpCacheHits;
+	long long icpRefined, icpSkipped, icpTruncated;
+	long long asyncPosted, asyncMerged, asyncAborted, asyncAdopted;
+	double asyncWaitTime;
+
 private:
 	//temp variables
 	float * normData;
+	float * rotNormData; // distance to the rotation centre, or to the z axis for yaw
+	int * dataOrder;
+	int subsetNum;
+	int maxNormIdx;
+	float maxDataNorm; // largest normData, differs from normData[maxNormIdx] for yaw
+	float dataRot[3][3]; // rotation applied to pDataTemp
+	vector< vector<DATACLUSTER> > clusters; // octree levels of data clusters, coarsest first
+	vector<float> clusterRadius; // largest cluster radius of each level
+	vector< vector<POINT3D> > clusterTemp; // cluster centroids rotated by dataRot
+	vector<bool> clusterRotated;
+	vector< pair<float,int> > clusterTerms;
+	map<pair<int, long long>, float> shellCache; // shell bounds of translation cubes
 	float * minDis;
-	float** maxRotDis;
+	float * minDis8; // per-point distances of the 8 translation subcubes, subcube-major
+	float * lbDis8; // per-point lower bound distances of the 8 subcubes, for trimming with box bounds or yaw radii
+	vector<float*> maxRotDis;
+	float * nodeRotDis; // per-node rotation uncertainty distances (quaternion face cells)
 	float * maxRotDisL;
 	POINT3D * pDataTemp;
-	POINT3D * pDataTempICP;
 	
 	ICP3D<float> icp3d;
+	CPTGRID cptGrid;
 	float * M_icp;
 	float * D_icp;
+	float * refineDis[2]; // residuals of the current and the trial pose (LOCAL_DT_LM)
+
+	// ICP invocation policy: current iteration cap, start error of the last refinement of an
+	// upper bound, and whether the incumbent was left unrefined
+	size_t icpIterCap;
+	float icpLastStart;
+	bool icpDeferred;
+
+	// ICP results (icpCacheSize), indexed by their pose quantized to DT voxels
+	vector<ICPCACHEENTRY> icpCache;
+	map<long long, int> icpCacheIndex;
+
+	// Background ICP (asyncICP): a single pending start pose, which a more promising one replaces,
+	// and the best finished result until the outer search adopts it
+	bool asyncRunning;
+	thread asyncThread;
+	mutex asyncMutex;
+	condition_variable asyncCond;
+	bool asyncPending, asyncBusy, asyncStop, asyncHaveResult;
+	Matrix asyncR, asyncT, asyncResultR, asyncResultT;
+	float asyncStartError, asyncResultError;
+	atomic<float> asyncAbortAbove; // start error of the pending pose, a worse running ICP stops
+	float * asyncDis;
 
 	float ICP(Matrix& R_icp, Matrix& t_icp);
-	float InnerBnB(float* maxRotDisL, TRANSNODE* nodeTransOut);
+	float ICPRun(Matrix& R_icp, Matrix& t_icp, float* dis);
+	void RefineIncumbent(bool force);
+	float PoseDistance(const Matrix& R1, const Matrix& t1, const Matrix& R2, const Matrix& t2);
+	long long PoseKey(const Matrix& R, const Matrix& t);
+	void AsyncICPStart();
+	void AsyncICPPost(const Matrix& R, const Matrix& t, float error);
+	void AsyncICPAdopt(ROTQUEUE& queueRot);
+	void AsyncICPFinish();
+	void AsyncICPWorker();
+	void PruneRotQueue(ROTQUEUE& queueRot);
+	float PoseError(const Matrix& R, const Matrix& t, float* dis);
+	float DTRefine(Matrix& R, Matrix& t);
+	float DTRefineError(const double R[3][3], const double t[3], float* dis, float& thresh);
+	float DTAt(float x, float y, float z)
+	{
+		return registrationMode == REG_PLANAR ? dt2.Distance(x, y) : dt.Distance(x, y, z);
+	}
+	void MultiStartPoses(vector<Matrix>& startR, vector<Matrix>& startT);
+	void MultiStartICP();
+	float ShellLB(const TRANSNODE& node);
+	float* RotDisAtLevel(int l);
+	float RotCellAngle(const ROTNODE& nodeRot);
+	float* RotDisAtCell(const ROTNODE& nodeRot);
+	void RefineLeaf(const Matrix& R_leaf, const Matrix& t_leaf);
+	void NodeRotation(const ROTNODE& nodeRot, Matrix& R);
+	void RotateData(const Matrix& R);
+	template <int ROTDOMAIN> void RotateDataKernel(const Matrix& R);
+	float RotNodeUB(ROTNODE& nodeRot, const Matrix& R, ROTQUEUE& queueRot);
+	void StratifyData();
+	void BuildClusters();
+	int ClusterLevel(float uncertainty);
+	void ClusterLB(int c, float* maxRotDisL, float maxTransDis, const float* transX, const float* transY, const float* transZ, float* lbs);
+	float TransError(float* maxRotDisL, const POINT3D& trans, int n);
+	float InnerBnB(float* maxRotDisL, TRANSNODE* nodeTransOut, const POINT3D* transSeeds = NULL, int numSeeds = 0, bool subsetOnly = false);
+	template <int DIM> float InnerBnBKernel(float* maxRotDisL, TRANSNODE* nodeTransOut, const POINT3D* transSeeds, int numSeeds, bool subsetOnly);
+	template <int DIM> float DTDistance(float x, float y, float z)
+	{
+		return DIM == 2 ? dt2.Distance(x, y) : dt.Distance(x, y, z);
+	}
 	float OuterBnB();
+	float TransOnlyBnB();
+	void PrintSearchStats(const char* name, int mode, const SEARCHSTATS& stats);
+	void PrintLocalStats();
 	void Initialize();
 	void Clear();
 
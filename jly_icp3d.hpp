@@ -27,8 +27,86 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "matrix.h"
 #include "nanoflann.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <math.h>
 using namespace nanoflann;
 
+// The correspondence search and the covariance reduction run on the OpenMP threads of the
+// solver when there are at least this many data points. Inside an already parallel region
+// (e.g. the multi-start ICP) they stay on the calling thread.
+#define ICP_PARALLEL_MIN 256
+// The covariance is reduced over this many fixed blocks of inliers, summed in order, so that
+// the result does not depend on the number of threads
+#define ICP_BLOCKS 64
+// Neighbours used to estimate each model normal (point-to-plane ICP)
+#define ICP_NORMAL_K 10
+// Neighbours per model point in the graph that warm-starts the correspondence search, and the
+// moves along it before falling back to the kdtree
+#define ICP_GRAPH_K 8
+#define ICP_GRAPH_HOPS 4
+// Coarse-to-fine runs: each stage uses ICP_COARSE_RATIO times fewer data points than the next
+// (at least ICP_COARSE_MIN) and converges with an ICP_COARSE_TOL times looser threshold
+#define ICP_COARSE_RATIO 4
+#define ICP_COARSE_MIN 100
+#define ICP_COARSE_TOL 10
+
+// Eigen decomposition of a symmetric N x N matrix by cyclic Jacobi sweeps: A is diagonalized
+// in place (eigenvalues on the diagonal) and the columns of V are the eigenvectors
+template <int N>
+inline void SymEigen(double A[N][N], double V[N][N])
+{
+	double off, theta, tt, c, s, h, g;
+	int i, j, k, p, q, sweep;
+
+	for(i = 0; i < N; i++)
+		for(j = 0; j < N; j++)
+			V[i][j] = (i == j);
+
+	for(sweep = 0; sweep < 50; sweep++)
+	{
+		off = 0;
+		for(p = 0; p < N-1; p++)
+			for(q = p+1; q < N; q++)
+				off += A[p][q]*A[p][q];
+		if(off < 1e-30)
+			break;
+
+		for(p = 0; p < N-1; p++)
+		for(q = p+1; q < N; q++)
+		{
+			if(A[p][q] == 0)
+				continue;
+
+			// Rotation in the (p,q) plane zeroing A[p][q]
+			theta = (A[q][q] - A[p][p])/(2*A[p][q]);
+			tt = (theta >= 0 ? 1 : -1)/(fabs(theta) + sqrt(theta*theta + 1));
+			c = 1/sqrt(tt*tt + 1);
+			s = tt*c;
+
+			for(k = 0; k < N; k++)
+			{
+				g = A[k][p]; h = A[k][q];
+				A[k][p] = c*g - s*h;
+				A[k][q] = s*g + c*h;
+			}
+			for(k = 0; k < N; k++)
+			{
+				g = A[p][k]; h = A[q][k];
+				A[p][k] = c*g - s*h;
+				A[q][k] = s*g + c*h;
+			}
+			for(k = 0; k < N; k++)
+			{
+				g = V[k][p]; h = V[k][q];
+				V[k][p] = c*g - s*h;
+				V[k][q] = s*g + c*h;
+			}
+		}
+	}
+}
+
 
 // A custom data set class to use nanoflann
 template <typename T>
@@ -78,6 +156,21 @@ struct POINTREF
 	int id_model;
 };
 
+inline bool operator < (const struct POINTREF & p1, const struct POINTREF & p2)
+{
+	return p1.dis < p2.dis;
+}
+
+// Closest-point transform of the model (e.g. from DT3D): index of the nearest model point of
+// each voxel of a size^3 grid, z-major, voxel (i,j,k) centred at (xMin+i/scale, yMin+j/scale, zMin+k/scale),
+// -1 where unknown
+struct CPTGRID
+{
+	const int * index;
+	int size;
+	double xMin, yMin, zMin, scale;
+};
+
 template <typename T>
 class ICP3D
 {
@@ -89,16 +182,41 @@ public:
 	T err_diff_def;
 	T trim_fraction;
 	bool do_trim;
+	// With a closest-point grid, correspondences are looked up in O(1) instead of searched in the
+	// kdtree. They are approximate (the nearest model point of the voxel), cpt_exact_final goes on
+	// with exact kdtree correspondences once the grid iterations have converged.
+	const CPTGRID * cpt_grid;
+	bool cpt_exact_final;
+	// Minimize point-to-plane distances, with model normals estimated in Build (set it before)
+	bool point_to_plane;
+	// From the second iteration on, search each point's closest model point from the previous
+	// one along a model kNN graph built in Build (set it before), with the kdtree as fallback
+	bool warm_start;
+	// Number of subsampled stages run before the full data (0 for none). The stages use
+	// prefixes of the data, which should therefore be in random order.
+	int coarse_stages;
+	// Wall-clock limit of each run in seconds (0 for none)
+	double time_limit;
+	// Runs stop early (setting aborted) once their error exceeds *abort_above, which another
+	// thread may lower while they iterate
+	const std::atomic<T> * abort_above;
+	bool aborted;
 	void Build(T * model, size_t n);
 	T Run(T * data, size_t n, Matrix & R, Matrix & t);
 	T Run(T * data, size_t n, Matrix & R, Matrix & t, size_t max_iter);
 	T Run(T * data, size_t n, Matrix & R, Matrix & t, T err_diff);
 	T Run(T * data, size_t n, Matrix & R, Matrix & t, size_t max_iter, T err_diff);
+	T Run(T * data, size_t n, Matrix & R, Matrix & t, struct POINTREF * points);
+	// The same, stopped at a steady_clock deadline in seconds since its epoch (0 for none);
+	// iterations is max_iter_def when a limit stopped the run
+	T Run(T * data, size_t n, Matrix & R, Matrix & t, struct POINTREF * points, double deadline, size_t & iterations);
+	T RunPlanar(T * data, size_t n, Matrix & R, Matrix & t);
+	// The iterations of the full data are returned in iterations, max_iter when a limit stopped the run
+	T Run(T * data, size_t n, Matrix & R, Matrix & t, size_t max_iter, size_t & iterations);
+	T RunPlanar(T * data, size_t n, Matrix & R, Matrix & t, size_t max_iter, size_t & iterations);
 
 private:
 
-	static int cmp(const void * a, const void * b);
-
 	PointCloud<T> model_;
 
 	KDTreeSingleIndexAdaptor<
@@ -106,6 +224,34 @@ private:
 		PointCloud<T>,
 		3 /* dim */
 	> * kdtree;
+
+	// Unit normals of the model points (point_to_plane), 3 per point
+	std::vector<T> normals_;
+
+	// ICP_GRAPH_K nearest neighbours of each model point (warm_start), and the distance
+	// to the farthest of them
+	std::vector<int> graph_;
+	std::vector<T> graph_radius_;
+
+	// Correspondence buffer of the runs without a caller-owned one, grown on demand
+	struct POINTREF * points_;
+	size_t points_size_;
+
+	size_t InlierNum(size_t n);
+	struct POINTREF * Points(size_t n);
+	T Correspond(const T * data, size_t n, size_t num, const double R[3][3], const double t[3], struct POINTREF * points, bool useGrid, bool warm);
+	bool GraphNearest(const T * query, size_t start, size_t & ret_index, T & out_dist_sqr);
+	T RunStaged(T * data, size_t n, Matrix & R, Matrix & t, size_t max_iter, T err_diff, struct POINTREF * points, size_t * iterations, double deadline);
+	T RunKernel(T * data, size_t n, Matrix & R, Matrix & t, size_t max_iter, T err_diff, struct POINTREF * points, size_t n_full, double deadline, size_t * iterations);
+	static double Now()
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	static void HornRotation(const double S[3][3], double R[3][3]);
+	static bool SolveSym6(const double H[6][6], const double g[6], double x[6]);
+	static void PlaneStep(const double x[6], double R[3][3], double t[3]);
+	void BuildNormals();
+	void BuildGraph();
 };
 
 template <typename T>
@@ -117,6 +263,16 @@ ICP3D<T>::ICP3D()
 	do_trim = true;
 
 	kdtree = NULL;
+	cpt_grid = NULL;
+	cpt_exact_final = false;
+	point_to_plane = false;
+	warm_start = false;
+	coarse_stages = 0;
+	time_limit = 0;
+	abort_above = NULL;
+	aborted = false;
+	points_ = NULL;
+	points_size_ = 0;
 }
 
 template <typename T>
@@ -124,6 +280,8 @@ ICP3D<T>::~ICP3D()
 {
 	if(kdtree != NULL)
 		delete(kdtree);
+	if(points_ != NULL)
+		free(points_);
 }
 
 template <typename T>
@@ -151,12 +309,166 @@ void ICP3D<T>::Build(T * model, size_t n)
 	>(3 /*dim*/, model_, KDTreeSingleIndexAdaptorParams(10 /* max leaf */) );
 
 	kdtree->buildIndex();
+
+	normals_.clear();
+	if(point_to_plane)
+		BuildNormals();
+	graph_.clear();
+	graph_radius_.clear();
+	if(warm_start && n > ICP_GRAPH_K)
+		BuildGraph();
+}
+
+// Model kNN graph of warm_start, built with the kdtree in parallel
+template <typename T>
+void ICP3D<T>::BuildGraph()
+{
+	int i, n = (int)model_.pts.size();
+
+	graph_.resize((size_t)n*ICP_GRAPH_K);
+	graph_radius_.resize(n);
+
+	#pragma omp parallel for schedule(static)
+	for(i = 0; i < n; i++)
+	{
+		size_t nn_index[ICP_GRAPH_K+1];
+		T nn_dist[ICP_GRAPH_K+1];
+		T query[3];
+		int j, k;
+
+		query[0] = model_.pts[i].x;
+		query[1] = model_.pts[i].y;
+		query[2] = model_.pts[i].z;
+		kdtree->knnSearch(&query[0], ICP_GRAPH_K+1, &nn_index[0], &nn_dist[0]);
+
+		// The point itself is among the results (not necessarily first with duplicates)
+		for(j = 0, k = 0; j <= ICP_GRAPH_K && k < ICP_GRAPH_K; j++)
+			if(nn_index[j] != (size_t)i)
+				graph_[(size_t)i*ICP_GRAPH_K + k++] = (int)nn_index[j];
+		graph_radius_[i] = sqrt(nn_dist[ICP_GRAPH_K]);
+	}
+}
+
+// Closest model point of query by moving along the kNN graph from start. The result is exact:
+// the points outside the list of m are at least radius(m) - |query - m| away, so the search
+// ends once the best of m and its neighbours is that close. Otherwise it returns false with
+// the closest point met, which still bounds a kdtree search.
+template <typename T>
+bool ICP3D<T>::GraphNearest(const T * query, size_t start, size_t & ret_index, T & out_dist_sqr)
+{
+	size_t m = start, best, p;
+	T dm, db, d, dx, dy, dz;
+	int hop, k;
+	bool exact = false;
+
+	dx = query[0] - model_.pts[m].x;
+	dy = query[1] - model_.pts[m].y;
+	dz = query[2] - model_.pts[m].z;
+	dm = dx*dx + dy*dy + dz*dz;
+	for(hop = 0; hop < ICP_GRAPH_HOPS; hop++)
+	{
+		best = m;
+		db = dm;
+		for(k = 0; k < ICP_GRAPH_K; k++)
+		{
+			p = graph_[m*ICP_GRAPH_K + k];
+			dx = query[0] - model_.pts[p].x;
+			dy = query[1] - model_.pts[p].y;
+			dz = query[2] - model_.pts[p].z;
+			d = dx*dx + dy*dy + dz*dz;
+			if(d < db)
+			{
+				db = d;
+				best = p;
+			}
+		}
+		exact = sqrt(db) + sqrt(dm) <= graph_radius_[m];
+		if(best == m)
+			break;
+		m = best;
+		dm = db;
+		if(exact)
+			break;
+	}
+	ret_index = m;
+	out_dist_sqr = dm;
+	return exact;
+}
+
+// Normal of each model point: the direction of least variance of its ICP_NORMAL_K nearest
+// neighbours (itself included), found with the kdtree in parallel
+template <typename T>
+void ICP3D<T>::BuildNormals()
+{
+	int i, n = (int)model_.pts.size();
+	int kn = n < ICP_NORMAL_K ? n : ICP_NORMAL_K;
+
+	normals_.assign(3*n, 0);
+
+	#pragma omp parallel for schedule(static)
+	for(i = 0; i < n; i++)
+	{
+		size_t nn_index[ICP_NORMAL_K];
+		T nn_dist[ICP_NORMAL_K];
+		T query[3];
+		double mu[3], d[3], C[3][3], V[3][3];
+		int j, k, l, best;
+
+		query[0] = model_.pts[i].x;
+		query[1] = model_.pts[i].y;
+		query[2] = model_.pts[i].z;
+		kdtree->knnSearch(&query[0], kn, &nn_index[0], &nn_dist[0]);
+
+		memset(mu, 0, sizeof(mu));
+		for(j = 0; j < kn; j++)
+		{
+			mu[0] += model_.pts[nn_index[j]].x;
+			mu[1] += model_.pts[nn_index[j]].y;
+			mu[2] += model_.pts[nn_index[j]].z;
+		}
+		for(k = 0; k < 3; k++)
+			mu[k] /= kn;
+
+		memset(C, 0, sizeof(C));
+		for(j = 0; j < kn; j++)
+		{
+			d[0] = model_.pts[nn_index[j]].x - mu[0];
+			d[1] = model_.pts[nn_index[j]].y - mu[1];
+			d[2] = model_.pts[nn_index[j]].z - mu[2];
+			for(k = 0; k < 3; k++)
+				for(l = 0; l < 3; l++)
+					C[k][l] += d[k]*d[l];
+		}
+
+		SymEigen<3>(C, V);
+		best = 0;
+		for(k = 1; k < 3; k++)
+			if(C[k][k] < C[best][best])
+				best = k;
+		for(k = 0; k < 3; k++)
+			normals_[3*i+k] = V[k][best];
+	}
 }
 
 template <typename T>
-int ICP3D<T>::cmp(const void * a, const void * b)
+size_t ICP3D<T>::InlierNum(size_t n)
 {
-	return ((struct POINTREF*)a)->dis > ((struct POINTREF*)b)->dis ? 1:-1;
+	if(do_trim)
+		return (size_t)(n*(1-trim_fraction));
+	return n;
+}
+
+template <typename T>
+struct POINTREF * ICP3D<T>::Points(size_t n)
+{
+	if(n > points_size_)
+	{
+		if(points_ != NULL)
+			free(points_);
+		points_ = (struct POINTREF *)malloc(sizeof(struct POINTREF)*n);
+		points_size_ = n;
+	}
+	return points_;
 }
 
 template <typename T>
@@ -180,115 +492,521 @@ T ICP3D<T>::Run(T * data, size_t n, Matrix & R, Matrix & t, T err_diff)
 template <typename T>
 T ICP3D<T>::Run(T * data, size_t n, Matrix & R, Matrix & t, size_t max_iter, T err_diff)
 {
-  size_t num;
+	return RunStaged(data, n, R, t, max_iter, err_diff, Points(n), NULL, 0);
+}
 
-	T query[3];
-	std::vector<size_t> ret_index(1);
-	std::vector<T> out_dist_sqr(1);
+template <typename T>
+T ICP3D<T>::Run(T * data, size_t n, Matrix & R, Matrix & t, size_t max_iter, size_t & iterations)
+{
+	return RunStaged(data, n, R, t, max_iter, err_diff_def, Points(n), &iterations, 0);
+}
 
-	if(do_trim)
+// points is a scratch buffer of n entries, so that several runs can share the kdtree concurrently
+template <typename T>
+T ICP3D<T>::Run(T * data, size_t n, Matrix & R, Matrix & t, struct POINTREF * points)
+{
+	return RunStaged(data, n, R, t, max_iter_def, err_diff_def, points, NULL, 0);
+}
+
+template <typename T>
+T ICP3D<T>::Run(T * data, size_t n, Matrix & R, Matrix & t, struct POINTREF * points, double deadline, size_t & iterations)
+{
+	return RunStaged(data, n, R, t, max_iter_def, err_diff_def, points, &iterations, deadline);
+}
+
+// The coarse stages converge on growing prefixes of the data, each starting from the pose
+// of the previous one, so that the full data only needs the last few iterations
+template <typename T>
+T ICP3D<T>::RunStaged(T * data, size_t n, Matrix & R, Matrix & t, size_t max_iter, T err_diff, struct POINTREF * points, size_t * iterations, double deadline)
+{
+	size_t m;
+	int s, k;
+
+	// The run stops at the earlier of the given deadline and time_limit
+	if(time_limit > 0 && (deadline <= 0 || Now() + time_limit < deadline))
+		deadline = Now() + time_limit;
+
+	if(iterations != NULL)
+		*iterations = 0;
+
+	for(s = coarse_stages; s > 0; s--)
 	{
-	  num = (int)(n*(1-trim_fraction));
+		m = n;
+		for(k = 0; k < s; k++)
+			m /= ICP_COARSE_RATIO;
+		if(m < ICP_COARSE_MIN)
+			continue;
+		RunKernel(data, m, R, t, max_iter, err_diff*ICP_COARSE_TOL, points, n, deadline, NULL);
+		if(abort_above != NULL && aborted)
+			return 0;
 	}
-	else
+
+	return RunKernel(data, n, R, t, max_iter, err_diff, points, n, deadline, iterations);
+}
+
+// Find the closest model point of every data point transformed by R, t, and move the num
+// closest pairs to the front of points (partial selection, they are not sorted)
+// Returns the sum of their squared distances
+template <typename T>
+T ICP3D<T>::Correspond(const T * data, size_t n, size_t num, const double R[3][3], const double t[3], struct POINTREF * points, bool useGrid, bool warm)
+{
+	int i;
+	T err = 0;
+
+	// Each query only reads the kdtree and writes its own entry. Warm-started, the entries
+	// keep their data point (in the order the last trimming left them) and start from its
+	// last closest model point.
+	#pragma omp parallel for schedule(static) if(n >= ICP_PARALLEL_MIN)
+	for(i = 0; i < (int)n; i++)
 	{
-	  num = n;
+		T query[3];
+		size_t ret_index;
+		T out_dist_sqr;
+		size_t id_data = warm ? points[i].id_data : (size_t)i;
+		size_t idx = id_data*3;
+
+		//transform point according to R and T
+		query[0] = R[0][0]*data[idx+0] + R[0][1]*data[idx+1] + R[0][2]*data[idx+2] + t[0];
+		query[1] = R[1][0]*data[idx+0] + R[1][1]*data[idx+1] + R[1][2]*data[idx+2] + t[1];
+		query[2] = R[2][0]*data[idx+0] + R[2][1]*data[idx+1] + R[2][2]*data[idx+2] + t[2];
+
+		ret_index = (size_t)-1;
+		if(useGrid)
+		{
+			// Voxel of the query, clamped to the grid
+			const CPTGRID & g = *cpt_grid;
+			int gx = (int)((query[0]-g.xMin)*g.scale + 0.5);
+			int gy = (int)((query[1]-g.yMin)*g.scale + 0.5);
+			int gz = (int)((query[2]-g.zMin)*g.scale + 0.5);
+			if(gx < 0) gx = 0; else if(gx >= g.size) gx = g.size-1;
+			if(gy < 0) gy = 0; else if(gy >= g.size) gy = g.size-1;
+			if(gz < 0) gz = 0; else if(gz >= g.size) gz = g.size-1;
+			int id = g.index[((size_t)gz*g.size + gy)*g.size + gx];
+			if(id >= 0)
+			{
+				const typename PointCloud<T>::Point & m = model_.pts[id];
+				ret_index = id;
+				out_dist_sqr = (query[0]-m.x)*(query[0]-m.x) + (query[1]-m.y)*(query[1]-m.y) + (query[2]-m.z)*(query[2]-m.z);
+			}
+		}
+		else if(warm && !GraphNearest(query, points[i].id_model, ret_index, out_dist_sqr))
+		{
+			// The kdtree search only needs to look closer than the graph's best point.
+			// init() resets the distance, so the seed is copied first.
+			size_t seed_index = ret_index;
+			T seed_dist = out_dist_sqr;
+			KNNResultSet<T> resultSet(1);
+			resultSet.init(&ret_index, &out_dist_sqr);
+			resultSet.addPoint(seed_dist, seed_index);
+			kdtree->findNeighbors(resultSet, &query[0], SearchParams());
+		}
+
+		//search nearest neighbor
+		if(ret_index == (size_t)-1)
+			kdtree->knnSearch(&query[0], 1, &ret_index, &out_dist_sqr);
+
+		points[i].dis = out_dist_sqr;
+		points[i].id_data = id_data;
+		points[i].id_model = ret_index;
 	}
 
-	struct POINTREF * points = (struct POINTREF *)malloc(sizeof(struct POINTREF)*n);
+	if(num < n)
+		std::nth_element(points, points + num, points + n);
 
-	// init matrix for point correspondences
-	Matrix p_m(num,3); // model
-	Matrix p_d(num,3); // data
+	for(i = 0; i < (int)num; i++)
+		err += points[i].dis;
 
-	// init mean
-	Matrix mu_m(1,3);
-	Matrix mu_d(1,3);
+	return err;
+}
 
-	size_t iter, idx, i;
-	T err = -1, err_new;
-	for(iter = 0; iter < max_iter; iter++)
+// Rotation R minimizing sum |R d_i - m_i|^2 given the cross-covariance S = sum d_i m_i^T
+// of the centred pairs (Horn's closed form: the unit quaternion is the eigenvector of the
+// largest eigenvalue of a symmetric 4x4 matrix)
+template <typename T>
+void ICP3D<T>::HornRotation(const double S[3][3], double R[3][3])
+{
+	double N[4][4], V[4][4];
+	int i, best;
+
+	N[0][0] = S[0][0] + S[1][1] + S[2][2];
+	N[1][1] = S[0][0] - S[1][1] - S[2][2];
+	N[2][2] = -S[0][0] + S[1][1] - S[2][2];
+	N[3][3] = -S[0][0] - S[1][1] + S[2][2];
+	N[0][1] = N[1][0] = S[1][2] - S[2][1];
+	N[0][2] = N[2][0] = S[2][0] - S[0][2];
+	N[0][3] = N[3][0] = S[0][1] - S[1][0];
+	N[1][2] = N[2][1] = S[0][1] + S[1][0];
+	N[1][3] = N[3][1] = S[2][0] + S[0][2];
+	N[2][3] = N[3][2] = S[1][2] + S[2][1];
+
+	SymEigen<4>(N, V);
+
+	best = 0;
+	for(i = 1; i < 4; i++)
+		if(N[i][i] > N[best][best])
+			best = i;
+
+	double qw = V[0][best], qx = V[1][best], qy = V[2][best], qz = V[3][best];
+	double n = sqrt(qw*qw + qx*qx + qy*qy + qz*qz);
+	qw /= n; qx /= n; qy /= n; qz /= n;
+
+	R[0][0] = 1 - 2*(qy*qy + qz*qz); R[0][1] = 2*(qx*qy - qz*qw);     R[0][2] = 2*(qx*qz + qy*qw);
+	R[1][0] = 2*(qx*qy + qz*qw);     R[1][1] = 1 - 2*(qx*qx + qz*qz); R[1][2] = 2*(qy*qz - qx*qw);
+	R[2][0] = 2*(qx*qz - qy*qw);     R[2][1] = 2*(qy*qz + qx*qw);     R[2][2] = 1 - 2*(qx*qx + qy*qy);
+}
+
+// The pose is kept in fixed-size arrays and the inliers' sums (centroids and cross-covariance,
+// or the point-to-plane normal equations) are accumulated in one pass, so that the iterations
+// do not allocate
+template <typename T>
+T ICP3D<T>::RunKernel(T * data, size_t n, Matrix & R, Matrix & t, size_t max_iter, T err_diff, struct POINTREF * points, size_t n_full, double deadline, size_t * iterations)
+{
+	size_t num = InlierNum(n);
+	size_t iter;
+	int b, j, k, l;
+	T err = -1, err_new = 0, crit, abort_scale;
+	double R0[3][3], t0[3], R_[3][3], t_[3], Rn[3][3], tn[3];
+	double mu_m[3], mu_d[3], S[3][3], H[6][6], g[6], x[6];
+	// per block: sum m, sum d, sum d m^T; or the upper triangle of J^T J, J^T r and sum r^2
+	double part[ICP_BLOCKS][28];
+	bool useGrid = cpt_grid != NULL;
+	bool usePlane = point_to_plane && normals_.size() == 3*model_.pts.size();
+
+	if(num == 0)
+		return 0;
+	// abort_above is an error over the n_full points
+	abort_scale = (T)InlierNum(n_full)/num;
+
+	for(j = 0; j < 3; j++)
 	{
-		T r00 = R.val[0][0]; T r01 = R.val[0][1]; T r02 = R.val[0][2];
-		T r10 = R.val[1][0]; T r11 = R.val[1][1]; T r12 = R.val[1][2];
-		T r20 = R.val[2][0]; T r21 = R.val[2][1]; T r22 = R.val[2][2];
-		T t0  = t.val[0][0]; T t1  = t.val[1][0]; T t2  = t.val[2][0];
+		for(k = 0; k < 3; k++)
+			R0[j][k] = R.val[j][k];
+		t0[j] = t.val[j][0];
+	}
 
-		err_new = 0;
-		for(i = 0; i < n; i++)
+	for(iter = 0; iter < max_iter; iter++)
+	{
+		if(deadline > 0 && iter > 0 && Now() > deadline)
 		{
-			idx = i*3;
-
-			//transform point according to R and T
-			query[0] = r00*data[idx+0] + r01*data[idx+1] + r02*data[idx+2] + t0;
-			query[1] = r10*data[idx+0] + r11*data[idx+1] + r12*data[idx+2] + t1;
-			query[2] = r20*data[idx+0] + r21*data[idx+1] + r22*data[idx+2] + t2;
+			iter = max_iter;
+			break;
+		}
+		err_new = Correspond(data, n, num, R0, t0, points, useGrid, iter > 0 && !graph_.empty());
+		if(abort_above != NULL && err_new*abort_scale > *abort_above)
+		{
+			aborted = true;
+			break;
+		}
 
+		#pragma omp parallel for schedule(static) if(num >= ICP_PARALLEL_MIN)
+		for(b = 0; b < ICP_BLOCKS; b++)
+		{
+			double pm[3], pd[3], J[6], r;
+			double * acc = part[b];
+			const T * nm;
+			size_t i, idx;
+			int j, k, l;
+
+			memset(acc, 0, sizeof(part[b]));
+			for(i = b*num/ICP_BLOCKS; i < (b+1)*num/ICP_BLOCKS; i++)
+			{
+				const typename PointCloud<T>::Point & m = model_.pts[points[i].id_model];
+				idx = points[i].id_data*3;
+				pm[0] = m.x; pm[1] = m.y; pm[2] = m.z;
+				for(j = 0; j < 3; j++)
+					pd[j] = R0[j][0]*data[idx+0] + R0[j][1]*data[idx+1] + R0[j][2]*data[idx+2] + t0[j];
+				if(usePlane)
+				{
+					// r = n.(d - m), linearized in the update d + w x d + u
+					nm = &normals_[3*points[i].id_model];
+					r = nm[0]*(pd[0]-pm[0]) + nm[1]*(pd[1]-pm[1]) + nm[2]*(pd[2]-pm[2]);
+					J[0] = pd[1]*nm[2] - pd[2]*nm[1];
+					J[1] = pd[2]*nm[0] - pd[0]*nm[2];
+					J[2] = pd[0]*nm[1] - pd[1]*nm[0];
+					J[3] = nm[0]; J[4] = nm[1]; J[5] = nm[2];
+					for(j = 0, l = 0; j < 6; j++)
+					{
+						for(k = j; k < 6; k++)
+							acc[l++] += J[j]*J[k];
+						acc[21+j] += J[j]*r;
+					}
+					acc[27] += r*r;
+					continue;
+				}
+				for(j = 0; j < 3; j++)
+				{
+					acc[j] += pm[j];
+					acc[3+j] += pd[j];
+					for(k = 0; k < 3; k++)
+						acc[6+3*j+k] += pd[j]*pm[k];
+				}
+			}
+		}
 
-			//search nearest neighbor
-			kdtree->knnSearch(&query[0], 1, &ret_index[0], &out_dist_sqr[0]);
+		if(usePlane)
+		{
+			memset(H, 0, sizeof(H));
+			memset(g, 0, sizeof(g));
+			crit = 0;
+			for(b = 0; b < ICP_BLOCKS; b++)
+			{
+				for(j = 0, l = 0; j < 6; j++)
+				{
+					for(k = j; k < 6; k++)
+						H[j][k] += part[b][l++];
+					g[j] += part[b][21+j];
+				}
+				crit += part[b][27];
+			}
+		}
+		else
+		{
+			memset(mu_m, 0, sizeof(mu_m));
+			memset(mu_d, 0, sizeof(mu_d));
+			memset(S, 0, sizeof(S));
+			for(b = 0; b < ICP_BLOCKS; b++)
+			{
+				for(j = 0; j < 3; j++)
+				{
+					mu_m[j] += part[b][j];
+					mu_d[j] += part[b][3+j];
+					for(k = 0; k < 3; k++)
+						S[j][k] += part[b][6+3*j+k];
+				}
+			}
+			crit = err_new;
+		}
 
-			points[i].dis = out_dist_sqr[0];
-			points[i].id_data = i;
-			points[i].id_model = ret_index[0];
+		if(err > 0 && err - crit < err_diff*num)
+		{
+			// Converged on the grid correspondences, refine with exact ones from the same pose
+			if(useGrid && cpt_exact_final)
+			{
+				useGrid = false;
+				err = -1;
+				continue;
+			}
+			break;
 		}
+		err = crit;
 
-		if(do_trim)
+		if(usePlane)
 		{
-		  qsort(points, n, sizeof(struct POINTREF), cmp);
+			// compute the relative motion from the normal equations H x = -g
+			for(j = 0; j < 6; j++)
+				for(k = 0; k < j; k++)
+					H[j][k] = H[k][j];
+			if(!SolveSym6(H, g, x))
+				break;
+			PlaneStep(x, R_, t_);
+		}
+		else
+		{
+			// Centre the cross-covariance: sum (d - mu_d)(m - mu_m)^T = sum d m^T - num mu_d mu_m^T
+			for(j = 0; j < 3; j++)
+			{
+				mu_m[j] /= num;
+				mu_d[j] /= num;
+			}
+			for(j = 0; j < 3; j++)
+				for(k = 0; k < 3; k++)
+					S[j][k] -= num*mu_d[j]*mu_m[k];
+
+			// compute relative rotation matrix R and translation vector T
+			HornRotation(S, R_);
+			for(j = 0; j < 3; j++)
+				t_[j] = mu_m[j] - (R_[j][0]*mu_d[0] + R_[j][1]*mu_d[1] + R_[j][2]*mu_d[2]);
 		}
 
-		for(i = 0; i < num; i++)
+		// compose transformation
+		for(j = 0; j < 3; j++)
 		{
-			// set model point
-			p_m.val[i][0] = model_.pts[points[i].id_model].x; mu_m.val[0][0] += p_m.val[i][0];
-			p_m.val[i][1] = model_.pts[points[i].id_model].y; mu_m.val[0][1] += p_m.val[i][1];
-			p_m.val[i][2] = model_.pts[points[i].id_model].z; mu_m.val[0][2] += p_m.val[i][2];
+			for(k = 0; k < 3; k++)
+				Rn[j][k] = R_[j][0]*R0[0][k] + R_[j][1]*R0[1][k] + R_[j][2]*R0[2][k];
+			tn[j] = R_[j][0]*t0[0] + R_[j][1]*t0[1] + R_[j][2]*t0[2] + t_[j];
+		}
+		memcpy(R0, Rn, sizeof(R0));
+		memcpy(t0, tn, sizeof(t0));
+	}
+	if(iterations != NULL)
+		*iterations = iter;
 
-			idx = points[i].id_data*3;
-			// set query point
-			p_d.val[i][0] = r00*data[idx+0] + r01*data[idx+1] + r02*data[idx+2] + t0; mu_d.val[0][0] += p_d.val[i][0];
-			p_d.val[i][1] = r10*data[idx+0] + r11*data[idx+1] + r12*data[idx+2] + t1; mu_d.val[0][1] += p_d.val[i][1];
-			p_d.val[i][2] = r20*data[idx+0] + r21*data[idx+1] + r22*data[idx+2] + t2; mu_d.val[0][2] += p_d.val[i][2];
+	for(j = 0; j < 3; j++)
+	{
+		for(k = 0; k < 3; k++)
+			R.val[j][k] = R0[j][k];
+		t.val[j][0] = t0[j];
+	}
+
+	return err_new;
+}
 
-			err_new += points[i].dis;
+// Solve H x = -g for the symmetric positive semi-definite 6x6 H by Cholesky, with a small
+// ridge for the directions the correspondences do not constrain (e.g. sliding along a plane)
+// Returns false if H is empty
+template <typename T>
+bool ICP3D<T>::SolveSym6(const double H[6][6], const double g[6], double x[6])
+{
+	double L[6][6], s, ridge;
+	int i, j, k;
+
+	ridge = 0;
+	for(j = 0; j < 6; j++)
+		ridge += H[j][j];
+	if(ridge <= 0)
+		return false;
+	ridge *= 1e-9;
+
+	for(j = 0; j < 6; j++)
+	{
+		for(k = 0; k <= j; k++)
+		{
+			s = H[j][k] + (j == k ? ridge : 0);
+			for(i = 0; i < k; i++)
+				s -= L[j][i]*L[k][i];
+			L[j][k] = (j == k) ? sqrt(s > ridge ? s : ridge) : s/L[k][k];
 		}
+	}
+	for(j = 0; j < 6; j++)
+	{
+		s = -g[j];
+		for(i = 0; i < j; i++)
+			s -= L[j][i]*x[i];
+		x[j] = s/L[j][j];
+	}
+	for(j = 5; j >= 0; j--)
+	{
+		s = x[j];
+		for(i = j+1; i < 6; i++)
+			s -= L[i][j]*x[i];
+		x[j] = s/L[j][j];
+	}
+	return true;
+}
 
-		if(err > 0 && err - err_new < err_diff*num)
-			break;
-		err = err_new;
+// Rigid motion of the point-to-plane update x = (w, u): rotation exp(w), translation u
+template <typename T>
+void ICP3D<T>::PlaneStep(const double x[6], double R[3][3], double t[3])
+{
+	double w, v[3], ct, st;
+	int j, k;
 
-		// subtract mean
-		mu_m = mu_m/(T)n;
-		mu_d = mu_d/(T)n;
-		Matrix q_m = p_m - Matrix::ones(num,1)*mu_m;
-		Matrix q_t = p_d - Matrix::ones(num,1)*mu_d;
+	w = sqrt(x[0]*x[0] + x[1]*x[1] + x[2]*x[2]);
+	for(j = 0; j < 3; j++)
+	{
+		for(k = 0; k < 3; k++)
+			R[j][k] = (j == k);
+		t[j] = x[3+j];
+	}
+	if(w == 0)
+		return;
+
+	v[0] = x[0]/w; v[1] = x[1]/w; v[2] = x[2]/w;
+	ct = cos(w); st = sin(w);
+	for(j = 0; j < 3; j++)
+		for(k = 0; k < 3; k++)
+			R[j][k] = (j == k ? ct : 0) + (1-ct)*v[j]*v[k];
+	R[0][1] -= v[2]*st; R[0][2] += v[1]*st;
+	R[1][0] += v[2]*st; R[1][2] -= v[0]*st;
+	R[2][0] -= v[1]*st; R[2][1] += v[0]*st;
+}
 
-		// compute relative rotation matrix R and translation vector T
-		Matrix H = ~q_t*q_m;
-		Matrix U,W,V;
-		H.svd(U,W,V);
-		Matrix R_ = V*~U;
+// ICP restricted to rotations about the z axis and translations in the xy plane, for point
+// sets lying in the z = 0 plane. The 2D alignment has a closed form.
+template <typename T>
+T ICP3D<T>::RunPlanar(T * data, size_t n, Matrix & R, Matrix & t)
+{
+	size_t iterations;
 
-		//There are some problems with Matrix::det(), so it is not used
-		//R11*(R22*R33-R23*R32)
-		T a = R_.val[0][0]*(R_.val[1][1]* R_.val[2][2] - R_.val[1][2]*R_.val[2][1]);
-		//R12*(R21*R33-R23*R31)
-		T b = -R_.val[0][1]*(R_.val[1][0]* R_.val[2][2] - R_.val[1][2]*R_.val[2][0]);
-		//R13*(R21*R32-R22*R31)
-		T c = R_.val[0][2]*(R_.val[1][0]* R_.val[2][1] - R_.val[1][1]*R_.val[2][0]);
-		T det = a+b+c;
+	return RunPlanar(data, n, R, t, max_iter_def, iterations);
+}
 
-		Matrix tmp = Matrix::eye(3);
-		tmp.val[2][2] = det;
+template <typename T>
+T ICP3D<T>::RunPlanar(T * data, size_t n, Matrix & R, Matrix & t, size_t max_iter, size_t & iterations)
+{
+	size_t num = InlierNum(n);
+	struct POINTREF * points = Points(n);
+	size_t iter, idx, i;
+	int j, k;
+	T err = -1, err_new = 0;
+	double R0[3][3], t0[3], Rn[3][3], tn[3];
+	double mx, my, dx, dy, mux_m, muy_m, mux_d, muy_d, sxx, sxy, theta, c, s;
+	double deadline = time_limit > 0 ? Now() + time_limit : 0;
 
-		R_ = V*tmp*~U;
+	iterations = 0;
+	if(num == 0)
+		return 0;
 
-		Matrix t_ = ~mu_m - R_*~mu_d;
+	for(j = 0; j < 3; j++)
+	{
+		for(k = 0; k < 3; k++)
+			R0[j][k] = R.val[j][k];
+		t0[j] = t.val[j][0];
+	}
+
+	for(iter = 0; iter < max_iter; iter++)
+	{
+		if(deadline > 0 && iter > 0 && Now() > deadline)
+		{
+			iter = max_iter;
+			break;
+		}
+		err_new = Correspond(data, n, num, R0, t0, points, false, iter > 0 && !graph_.empty());
+		if(abort_above != NULL && err_new > *abort_above)
+		{
+			aborted = true;
+			break;
+		}
+
+		if(err > 0 && err - err_new < err_diff_def*num)
+			break;
+		err = err_new;
+
+		// Centroids and correlation of the pairs in one pass:
+		// sum (d - mu_d).(m - mu_m) = sum d.m - num mu_d.mu_m, and likewise for the cross term
+		mux_m = muy_m = mux_d = muy_d = sxx = sxy = 0;
+		for(i = 0; i < num; i++)
+		{
+			idx = points[i].id_data*3;
+			mx = model_.pts[points[i].id_model].x;
+			my = model_.pts[points[i].id_model].y;
+			dx = R0[0][0]*data[idx+0] + R0[0][1]*data[idx+1] + t0[0];
+			dy = R0[1][0]*data[idx+0] + R0[1][1]*data[idx+1] + t0[1];
+			mux_m += mx; muy_m += my;
+			mux_d += dx; muy_d += dy;
+			sxx += dx*mx + dy*my;
+			sxy += dx*my - dy*mx;
+		}
+		mux_m /= num; muy_m /= num;
+		mux_d /= num; muy_d /= num;
+		sxx -= num*(mux_d*mux_m + muy_d*muy_m);
+		sxy -= num*(mux_d*muy_m - muy_d*mux_m);
+
+		// Rotation angle maximizing the correlation of the centred point pairs
+		theta = atan2(sxy, sxx);
+		c = cos(theta);
+		s = sin(theta);
 
 		// compose transformation
-		R = R_*R;
-		t = R_*t + t_;
+		for(k = 0; k < 3; k++)
+		{
+			Rn[0][k] = c*R0[0][k] - s*R0[1][k];
+			Rn[1][k] = s*R0[0][k] + c*R0[1][k];
+			Rn[2][k] = R0[2][k];
+		}
+		tn[0] = c*t0[0] - s*t0[1] + mux_m - (c*mux_d - s*muy_d);
+		tn[1] = s*t0[0] + c*t0[1] + muy_m - (s*mux_d + c*muy_d);
+		tn[2] = t0[2];
+		memcpy(R0, Rn, sizeof(R0));
+		memcpy(t0, tn, sizeof(t0));
+	}
+	iterations = iter;
+
+	for(j = 0; j < 3; j++)
+	{
+		for(k = 0; k < 3; k++)
+			R.val[j][k] = R0[j][k];
+		t.val[j][0] = t0[j];
 	}
 
 	return err_new;
@@ -22,7 +22,7 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 *********************************************************************/
 
-#include <time.h>
+#include <chrono>
 #include <iostream>
 #include <fstream>
 using namespace std;
@@ -39,10 +39,16 @@ void parseInput(int argc, char **argv, string & modelFName, string & dataFName,
 void readConfig(string FName, GoICP & goicp);
 int loadPointCloud(string FName, int & N, POINT3D **  p);
 
+// Wall-clock seconds, the search may run ICP on other threads
+static double WallTime()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 int main(int argc, char** argv)
 {
 	int Nm, Nd, NdDownsampled;
-	clock_t  clockBegin, clockEnd;
+	double timeBegin, timeEnd;
 	string modelFName, dataFName, configFName, outputFname;
 	POINT3D * pModel, * pData;
 	GoICP goicp;
@@ -61,10 +67,12 @@ int main(int argc, char** argv)
 
 	// Build Distance Transform
 	cout << "Building Distance Transform..." << flush;
-	clockBegin = clock();
+	timeBegin = WallTime();
 	goicp.BuildDT();
-	clockEnd = clock();
-	cout << (double)(clockEnd - clockBegin)/CLOCKS_PER_SEC << "s (CPU)" << endl;
+	timeEnd = WallTime();
+	cout << timeEnd - timeBegin << "s" << endl;
+	if(goicp.dt.buildClosestPoint)
+		cout << "Closest-point transform: " << goicp.dt.closestPointMissing << " voxels unresolved (kdtree fallback)" << endl;
 
 	// Run GO-ICP
 	if(NdDownsampled > 0)
@@ -73,10 +81,10 @@ int main(int argc, char** argv)
 	}
 	cout << "Model ID: " << modelFName << " (" << goicp.Nm << "), Data ID: " << dataFName << " (" << goicp.Nd << ")" << endl;
 	cout << "Registering..." << endl;
-	clockBegin = clock();
+	timeBegin = WallTime();
 	goicp.Register();
-	clockEnd = clock();
-	double time = (double)(clockEnd - clockBegin)/CLOCKS_PER_SEC;
+	timeEnd = WallTime();
+	double time = timeEnd - timeBegin;
 	cout << "Optimal Rotation Matrix:" << endl;
 	cout << goicp.optR << endl;
 	cout << "Optimal Translation Vector:" << endl;
@@ -161,6 +169,48 @@ void readConfig(string FName, GoICP & goicp)
 	}
 	goicp.dt.SIZE = config.getI("distTransSize");
 	goicp.dt.expandFactor = config.getF("distTransExpandFactor");
+	goicp.upperBoundMode = config.getI("upperBoundMode");
+	goicp.lbSubsetSize = config.getI("lbSubsetSize");
+	goicp.dataClusterLevels = config.getI("dataClusterLevels");
+	goicp.transBoxBound = config.getI("transBoxBound") != 0;
+	goicp.shellBoundFactor = config.getF("shellBoundFactor");
+	goicp.rotSearchMode = config.getI("rotSearchMode");
+	goicp.transSearchMode = config.getI("transSearchMode");
+	goicp.diveInterval = config.getI("diveInterval");
+	goicp.multiStartCount = config.getI("multiStartCount");
+	goicp.multiStartTime = config.getF("multiStartTime");
+	goicp.rotDomain = config.getI("rotDomain");
+	goicp.icpClosestPoint = config.getI("icpClosestPoint");
+	goicp.icpPointToPlane = config.getI("icpPointToPlane") != 0;
+	goicp.icpWarmStart = config.getI("icpWarmStart") != 0;
+	goicp.icpCoarseStages = config.getI("icpCoarseStages");
+	goicp.localOptimizer = config.getI("localOptimizer");
+	goicp.asyncICP = config.getI("asyncICP") != 0;
+	goicp.icpCacheSize = config.getI("icpCacheSize");
+	goicp.icpMinImprovement = config.getF("icpMinImprovement");
+	goicp.icpTimeBudget = config.getF("icpTimeBudget");
+	goicp.icpAdaptiveIter = config.getI("icpAdaptiveIter") != 0;
+
+	// Fixed part of the pose for the rotation-only and translation-only modes,
+	// the rotation given in angle-axis form
+	goicp.registrationMode = config.getI("registrationMode");
+	float v1 = config.getF("fixedRotX");
+	float v2 = config.getF("fixedRotY");
+	float v3 = config.getF("fixedRotZ");
+	float t = sqrt(v1*v1 + v2*v2 + v3*v3);
+	goicp.fixedR = Matrix::eye(3);
+	if(t > 0)
+	{
+		v1 /= t; v2 /= t; v3 /= t;
+		float ct = cos(t), ct2 = 1 - ct, st = sin(t);
+		goicp.fixedR.val[0][0] = ct + v1*v1*ct2;		goicp.fixedR.val[0][1] = v1*v2*ct2 - v3*st;	goicp.fixedR.val[0][2] = v1*v3*ct2 + v2*st;
+		goicp.fixedR.val[1][0] = v1*v2*ct2 + v3*st;	goicp.fixedR.val[1][1] = ct + v2*v2*ct2;		goicp.fixedR.val[1][2] = v2*v3*ct2 - v1*st;
+		goicp.fixedR.val[2][0] = v1*v3*ct2 - v2*st;	goicp.fixedR.val[2][1] = v2*v3*ct2 + v1*st;	goicp.fixedR.val[2][2] = ct + v3*v3*ct2;
+	}
+	goicp.fixedT = Matrix(3,1);
+	goicp.fixedT.val[0][0] = config.getF("fixedTransX");
+	goicp.fixedT.val[1][0] = config.getF("fixedTransY");
+	goicp.fixedT.val[2][0] = config.getF("fixedTransZ");
 
 	cout << "CONFIG:" << endl;
 	config.print();
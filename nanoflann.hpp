@@ -807,7 +807,17 @@ namespace nanoflann
 			if (!root_node) throw std::runtime_error("[nanoflann] findNeighbors() called before building the index.");
 			float epsError = 1+searchParams.eps;
 
-			std::vector<DistanceType> dists( (DIM>0 ? DIM : dim) ,0);
+			// Fixed-dimension trees keep the per-query distances on the stack
+			DistanceType distsFixed[DIM>0 ? DIM : 1];
+			std::vector<DistanceType> distsDynamic;
+			DistanceType* dists = distsFixed;
+			if (DIM>0) {
+				for (int i = 0; i < DIM; ++i) distsFixed[i] = 0;
+			}
+			else {
+				distsDynamic.assign(dim, 0);
+				dists = &distsDynamic[0];
+			}
 			DistanceType distsq = computeInitialDistances(vec, dists);
 			searchLevel(result, vec, root_node, distsq, dists, epsError);  // "count_leaf" parameter removed since was neither used nor returned to the user.
 		}
@@ -1110,7 +1120,7 @@ namespace nanoflann
 			lim2 = left;
 		}
 
-		DistanceType computeInitialDistances(const ElementType* vec, std::vector<DistanceType>& dists) const
+		DistanceType computeInitialDistances(const ElementType* vec, DistanceType* dists) const
 		{
 			assert(vec);
 			DistanceType distsq = 0.0;
@@ -1135,7 +1145,7 @@ namespace nanoflann
 		 */
 		template <class RESULTSET>
 		void searchLevel(RESULTSET& result_set, const ElementType* vec, const NodePtr node, DistanceType mindistsq,
-						 std::vector<DistanceType>& dists, const float epsError) const
+						 DistanceType* dists, const float epsError) const
 		{
 			/* If this is a leaf node, then do check and return. */
 			if ((node->child1 == NULL)&&(node->child2 == NULL)) {